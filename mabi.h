@@ -45,6 +45,18 @@ typedef struct vm_map_info {
 	struct vm_memslot *slots;
 } vm_map_info_t;
 
+/// @brief progress of the VM mapping, shared with userspace by mmapping the map fd
+typedef struct vm_map_status {
+	/// Number of memory slots, in `vm_map_info_t` order, that are fully mapped in. Slots are mapped
+	/// in ascending guest physical address order, so every slot below this index may be accessed
+	__u32 ready_slots;
+	/// Non-zero once mapping has finished, successfully or not
+	__u32 done;
+	/// Zero, or negative error code, if mapping of slot `ready_slots` failed
+	__s32 error;
+} vm_map_status_t;
+
+
 #define MEMFLOW_IOCTL_MAGIC 0x6d
 
 /**
@@ -73,4 +85,31 @@ typedef struct vm_map_info {
 */
 #define MEMFLOW_MAP_VM _IOWR(MEMFLOW_IOCTL_MAGIC, 2, vm_map_info_t)
 
+/**
+ * @brief Map the VM asynchronously
+ *
+ * Same as MEMFLOW_MAP_VM, but the memory slots only get address space reserved for them, and are mapped
+ * in the background, lowest guest physical addresses first. The returned file descriptor can be used to
+ * track the progress:
+ *
+ * - mmapping a single page at offset 0 of it gives read-only access to the `vm_map_status_t` structure.
+ * - poll reports it readable, once mapping has finished (and errored, if it failed).
+ * - MEMFLOW_MAP_WAIT blocks until the given number of slots is mapped in.
+ *
+ * Accessing a slot that is not yet mapped in raises SIGBUS. Closing the fd stops the background mapping.
+ * The file descriptors returned by MEMFLOW_MAP_VM support the same operations, and are always finished.
+*/
+#define MEMFLOW_MAP_VM_ASYNC _IOWR(MEMFLOW_IOCTL_MAGIC, 3, vm_map_info_t)
+
+/**
+ * @brief Wait for slots of the VM mapping
+ *
+ * Called on the fd returned by MEMFLOW_MAP_VM_ASYNC. Blocks until at least as many memory slots as the
+ * argument are mapped in. Returns 0 on success, or a negative error code, if mapping failed before
+ * reaching the requested slot.
+ *
+ * The slot count is passed by value, not through a pointer.
+*/
+#define MEMFLOW_MAP_WAIT _IO(MEMFLOW_IOCTL_MAGIC, 4)
+
 #endif
@@ -9,6 +9,10 @@
 #include <linux/mm.h>
 #include <linux/mman.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/sched/mm.h>
 #include "mmap_lock.h"
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,17,0)
@@ -27,9 +31,16 @@ static const struct file_operations memflow_vm_fops = {
 };
 
 static int memflow_vm_mapped_release(struct inode *inode, struct file *filp);
+static int memflow_vm_mapped_mmap(struct file *filp, struct vm_area_struct *vma);
+static __poll_t memflow_vm_mapped_poll(struct file *filp, poll_table *wait);
+static long memflow_vm_mapped_ioctl(struct file *filp, unsigned int cmd, unsigned long argp);
 
 struct vm_vma_map {
+	// Range in the current process
 	unsigned long start, end;
+	// Difference between the current process, and the VMM addresses
+	unsigned long offset;
+	bool writable;
 };
 
 struct vm_mapped_data {
@@ -37,10 +48,21 @@ struct vm_mapped_data {
 	struct vm_vma_map vma_maps[KVM_MEM_SLOTS_NUM];
 	vm_map_info_t vm_map_info;
 	struct vm_memslot map_slots[KVM_MEM_SLOTS_NUM];
+	// Page shared with userspace
+	vm_map_status_t *status;
+	wait_queue_head_t map_wait;
+	// Background mapping state. The mm fields are only set for MEMFLOW_MAP_VM_ASYNC
+	struct work_struct map_work;
+	atomic_t stop;
+	struct task_struct *src_task;
+	struct mm_struct *src_mm, *dst_mm;
 };
 
 static const struct file_operations memflow_vm_mapped_fops = {
 	.release = memflow_vm_mapped_release,
+	.mmap = memflow_vm_mapped_mmap,
+	.poll = memflow_vm_mapped_poll,
+	.unlocked_ioctl = memflow_vm_mapped_ioctl,
 	.owner = THIS_MODULE
 };
 
@@ -193,7 +215,10 @@ struct vm_mem_data {
 	// This field is only valid pre-mmap call.
 	struct vm_area_struct *wrapped_vma;
 	struct task_struct *wrapped_task;
+	// Do not pin the pages in mmap, they get mapped in by map_vm_work instead
+	bool deferred;
 	int nr_pages;
+	// In deferred mode, entries are NULL until the page gets mapped in
 	struct page **pages;
 };
 
@@ -210,6 +235,50 @@ struct vm_mem_data {
 #define RELEASE_PAGE put_user_page
 #endif
 
+// Requires mm->mmap_sem to be held
+static long pin_pages(struct task_struct *task, struct mm_struct *mm, unsigned long start, unsigned long nr_pages, unsigned long foll_flags, struct page **pages)
+{
+	long ret;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,5,0)
+	struct vm_area_struct **tmp_vmas;
+
+	tmp_vmas = vmalloc(sizeof(*tmp_vmas) * nr_pages);
+	if (!tmp_vmas)
+		return -ENOMEM;
+#endif
+
+	ret = get_user_pages_remote(
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,9,0)
+		task,
+#endif
+		mm,
+		start,
+		nr_pages,
+		foll_flags,
+		pages,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,5,0)
+		tmp_vmas,
+#endif
+		NULL
+	);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,5,0)
+	// We really don't need them, but we vmalloc it, because the kernel kcallocs it, and it fails?
+	vfree(tmp_vmas);
+#endif
+
+	return ret;
+}
+
+static void mark_pfnmap(struct vm_area_struct *vma)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+	vma->vm_flags |= VM_PFNMAP | VM_DONTDUMP;
+#else
+	vm_flags_set(vma, VM_PFNMAP | VM_DONTDUMP);
+#endif
+}
+
 static int memflow_vm_mem_release(struct inode *inode, struct file *file)
 {
 	struct vm_mem_data *data = file->private_data;
@@ -218,7 +287,8 @@ static int memflow_vm_mem_release(struct inode *inode, struct file *file)
 	if (data) {
 		if (data->pages) {
 			for (i = 0; i < data->nr_pages; i++)
-				RELEASE_PAGE(data->pages[i]);
+				if (data->pages[i])
+					RELEASE_PAGE(data->pages[i]);
 			vfree(data->pages);
 		}
 
@@ -228,6 +298,16 @@ static int memflow_vm_mem_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
+static vm_fault_t memflow_vm_mem_deferred_fault(struct vm_fault *vmf)
+{
+	// The page has not been mapped in by map_vm_work yet
+	return VM_FAULT_SIGBUS;
+}
+
+static const struct vm_operations_struct memflow_vm_mem_deferred_ops = {
+	.fault = memflow_vm_mem_deferred_fault
+};
+
 static int memflow_vm_mem_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	struct vm_mem_data *data = file->private_data;
@@ -235,9 +315,6 @@ static int memflow_vm_mem_mmap(struct file *file, struct vm_area_struct *vma)
 	int i, ret = -1;
 	unsigned long foll_flags = PAGE_GET_FLAG|FOLL_GET;
 	pgprot_t remap_flags = PAGE_SHARED;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6,5,0)
-	struct vm_area_struct **tmp_vmas;
-#endif
 
 	if (vma->vm_flags & VM_WRITE)
 		foll_flags |= FOLL_WRITE;
@@ -247,45 +324,35 @@ static int memflow_vm_mem_mmap(struct file *file, struct vm_area_struct *vma)
 	if (data->wrapped_vma->vm_end - data->wrapped_vma->vm_start != nr_pages << PAGE_SHIFT)
 		goto do_return;
 
+	if (data->deferred) {
+		data->pages = vzalloc(sizeof(*data->pages) * nr_pages);
+
+		if (!data->pages)
+			goto do_return;
+
+		data->nr_pages = nr_pages;
+		mark_pfnmap(vma);
+
+		// Accesses fault with SIGBUS until map_vm_work remaps the pages
+		vma->vm_ops = &memflow_vm_mem_deferred_ops;
+
+		data->wrapped_vma = NULL;
+		data->wrapped_task = NULL;
+
+		return 0;
+	}
+
 	data->pages = vmalloc(sizeof(*data->pages) * nr_pages);
 
 	if (!data->pages)
 		goto do_return;
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6,5,0)
-	tmp_vmas = vmalloc(sizeof(*tmp_vmas) * nr_pages);
-	if (!tmp_vmas)
-		goto free_pages;
-#endif
-
-	data->nr_pages = get_user_pages_remote(
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5,9,0)
-		data->wrapped_task,
-#endif
-		data->wrapped_task->mm,
-		data->wrapped_vma->vm_start,
-		nr_pages,
-		foll_flags,
-		data->pages,
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6,5,0)
-		tmp_vmas,
-#endif
-		NULL
-	);
-
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6,5,0)
-	// We really don't need them, but we vmalloc it, because the kernel kcallocs it, and it fails?
-	vfree(tmp_vmas);
-#endif
+	data->nr_pages = pin_pages(data->wrapped_task, data->wrapped_task->mm, data->wrapped_vma->vm_start, nr_pages, foll_flags, data->pages);
 
 	if (data->nr_pages != nr_pages)
 		goto put_pages;
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
-	vma->vm_flags |= VM_PFNMAP | VM_DONTDUMP;
-#else
-	vm_flags_set(vma, VM_PFNMAP | VM_DONTDUMP);
-#endif
+	mark_pfnmap(vma);
 
 	ret = 0;
 
@@ -309,9 +376,6 @@ static int memflow_vm_mem_mmap(struct file *file, struct vm_area_struct *vma)
 put_pages:
 	for (i = 0; i < data->nr_pages; i++)
 		RELEASE_PAGE(data->pages[i]);
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6,5,0)
-free_pages:
-#endif
 	vfree(data->pages);
 	data->nr_pages = 0;
 	data->pages = NULL;
@@ -336,7 +400,7 @@ static const struct file_operations memflow_vm_mem_fops = {
 	.owner = THIS_MODULE
 };
 
-static unsigned long mmap_vma(struct vm_area_struct *vma, struct task_struct *task)
+static unsigned long mmap_vma(struct vm_area_struct *vma, struct task_struct *task, bool deferred)
 {
 	struct file *wrap_file;
 	unsigned long page_prot = PROT_READ;
@@ -349,6 +413,7 @@ static unsigned long mmap_vma(struct vm_area_struct *vma, struct task_struct *ta
 		goto do_return;
 
 	priv->pages = NULL;
+	priv->deferred = deferred;
 	priv->wrapped_vma = vma;
 	priv->wrapped_task = task;
 
@@ -373,7 +438,7 @@ do_return:
 }
 
 // Called with otask->mm->mm_sem locked for writing. Does not release the lock
-static void remap_vmas(struct vm_mapped_data *data, struct task_struct *otask)
+static void remap_vmas(struct vm_mapped_data *data, struct task_struct *otask, bool deferred)
 {
 	int i, o, u;
 	vm_memslot_t *slot;
@@ -390,7 +455,7 @@ static void remap_vmas(struct vm_mapped_data *data, struct task_struct *otask)
 		if (!vma)
 			goto remove_vma_map_entry;
 
-		retaddr = mmap_vma(vma, otask);
+		retaddr = mmap_vma(vma, otask, deferred);
 
 		if (IS_ERR((void *)retaddr))
 			goto remove_unmapped_slots;
@@ -405,8 +470,10 @@ static void remap_vmas(struct vm_mapped_data *data, struct task_struct *otask)
 			}
 		}
 
-		mapped_vma->start += retaddr;
+		mapped_vma->start += offset;
 		mapped_vma->end += offset;
+		mapped_vma->offset = offset;
+		mapped_vma->writable = !!(vma->vm_flags & VM_WRITE);
 
 		continue;
 
@@ -453,7 +520,157 @@ skip_slot:
 	}
 }
 
-static int do_map_vm(struct kvm *kvm, vm_map_info_t __user *user_info)
+// Number of pages pinned, and remapped at a time by map_vm_work. Bounds how long the mmap locks are held
+#define MAP_CHUNK_PAGES 512
+
+static struct vm_vma_map *find_vma_map(struct vm_mapped_data *data, unsigned long addr)
+{
+	int i;
+
+	for (i = 0; i < data->mapped_vma_count; i++)
+		if (addr >= data->vma_maps[i].start && addr < data->vma_maps[i].end)
+			return data->vma_maps + i;
+
+	return NULL;
+}
+
+// Pin nr_pages at the given address of the current process mapping, and remap them in
+static int map_chunk(struct vm_mapped_data *data, struct page **pages, unsigned long addr, unsigned long nr_pages)
+{
+	struct vm_vma_map *mapped_vma;
+	struct vm_area_struct *vma;
+	struct vm_mem_data *mem;
+	unsigned long foll_flags = PAGE_GET_FLAG|FOLL_GET;
+	pgprot_t remap_flags = PAGE_SHARED;
+	unsigned long i, idx;
+	long pinned;
+	int ret = -EFAULT;
+
+	mapped_vma = find_vma_map(data, addr);
+
+	if (!mapped_vma)
+		return -EFAULT;
+
+	if (mapped_vma->writable)
+		foll_flags |= FOLL_WRITE;
+	else
+		remap_flags = PAGE_READONLY;
+
+	mmap_read_lock(data->src_mm);
+	pinned = pin_pages(data->src_task, data->src_mm, addr - mapped_vma->offset, nr_pages, foll_flags, pages);
+	mmap_read_unlock(data->src_mm);
+
+	if (pinned < 0)
+		return pinned;
+
+	if (pinned != nr_pages)
+		goto put_pages;
+
+	mmap_write_lock(data->dst_mm);
+
+	// Userspace may have unmapped, or split the region in the meantime, look it up again
+	vma = find_vma(data->dst_mm, addr);
+
+	if (!vma || vma->vm_start > addr || vma->vm_end < addr + (nr_pages << PAGE_SHIFT))
+		goto unlock_mem;
+
+	if (!vma->vm_file || vma->vm_file->f_op != &memflow_vm_mem_fops)
+		goto unlock_mem;
+
+	mem = vma->vm_file->private_data;
+	idx = vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT);
+
+	if (!mem->deferred || !mem->pages || idx + nr_pages > mem->nr_pages)
+		goto unlock_mem;
+
+	ret = 0;
+
+	for (i = 0; i < nr_pages; i++) {
+		// Aliased memslots may have already mapped the page in
+		if (mem->pages[idx + i])
+			continue;
+
+		ret = remap_pfn_range(vma, addr + (i << PAGE_SHIFT), page_to_pfn(pages[i]), 1ul << PAGE_SHIFT, remap_flags);
+		if (ret)
+			break;
+
+		mem->pages[idx + i] = pages[i];
+		pages[i] = NULL;
+	}
+
+unlock_mem:
+	mmap_write_unlock(data->dst_mm);
+put_pages:
+	for (i = 0; i < pinned; i++)
+		if (pages[i])
+			RELEASE_PAGE(pages[i]);
+
+	return ret;
+}
+
+// Maps the slots in, in ascending guest physical address order, publishing progress in the status page
+static void map_vm_work(struct work_struct *work)
+{
+	struct vm_mapped_data *data = container_of(work, struct vm_mapped_data, map_work);
+	struct page **pages;
+	vm_memslot_t *slot;
+	unsigned long addr, end, nr_pages;
+	int i, ret = -ENOMEM;
+
+	pages = vmalloc(sizeof(*pages) * MAP_CHUNK_PAGES);
+
+	if (!pages)
+		goto do_return;
+
+	ret = -ESRCH;
+
+	if (!mmget_not_zero(data->src_mm))
+		goto free_pages;
+
+	if (!mmget_not_zero(data->dst_mm))
+		goto put_src;
+
+	ret = 0;
+
+	for (i = 0; i < data->vm_map_info.slot_count; i++) {
+		slot = data->vm_map_info.slots + i;
+		end = slot->host_base + slot->map_size;
+
+		for (addr = slot->host_base; addr < end; addr += nr_pages << PAGE_SHIFT) {
+			// Stop once the fd is closed, or the consumer exited, and only we hold its address space
+			if (atomic_read(&data->stop) || atomic_read(&data->dst_mm->mm_users) <= 1) {
+				ret = -EINTR;
+				goto put_dst;
+			}
+
+			nr_pages = min((end - addr) >> PAGE_SHIFT, (unsigned long)MAP_CHUNK_PAGES);
+
+			if ((ret = map_chunk(data, pages, addr, nr_pages)))
+				goto put_dst;
+
+			cond_resched();
+		}
+
+		smp_store_release(&data->status->ready_slots, i + 1);
+		wake_up_all(&data->map_wait);
+	}
+
+put_dst:
+	mmput(data->dst_mm);
+put_src:
+	mmput(data->src_mm);
+free_pages:
+	vfree(pages);
+do_return:
+	if (ret && ret != -EINTR)
+		mprintk("background mapping stopped at slot %u: %d\n", data->status->ready_slots, ret);
+
+	WRITE_ONCE(data->status->error, ret);
+	smp_store_release(&data->status->done, 1);
+	wake_up_all(&data->map_wait);
+}
+
+static int do_map_vm(struct kvm *kvm, vm_map_info_t __user *user_info, bool async)
 {
 	struct vm_mapped_data *priv;
 	int fd = -1, memslot_count;
@@ -480,6 +697,17 @@ static int do_map_vm(struct kvm *kvm, vm_map_info_t __user *user_info)
 
 	priv->mapped_vma_count = 0;
 	priv->vm_map_info.slot_count = 0;
+	priv->src_task = NULL;
+	priv->src_mm = NULL;
+	priv->dst_mm = NULL;
+	atomic_set(&priv->stop, 0);
+	init_waitqueue_head(&priv->map_wait);
+	INIT_WORK(&priv->map_work, map_vm_work);
+
+	priv->status = (vm_map_status_t *)get_zeroed_page(GFP_KERNEL);
+
+	if (!priv->status)
+		goto free_alloc;
 
 	if (copy_from_user(&user_info_copied, user_info, sizeof(vm_map_info_t)))
 		goto free_alloc;
@@ -523,8 +751,18 @@ static int do_map_vm(struct kvm *kvm, vm_map_info_t __user *user_info)
 	if (IS_ERR_OR_NULL(file))
 		goto unlock_mem;
 
+	// Keep both address spaces around for the background mapping. They get released with the file
+	if (async) {
+		get_task_struct(other_task);
+		priv->src_task = other_task;
+		mmgrab(other_mm);
+		priv->src_mm = other_mm;
+		mmgrab(current->mm);
+		priv->dst_mm = current->mm;
+	}
+
 	// Now remap all unique mappings
-	remap_vmas(priv, other_task);
+	remap_vmas(priv, other_task, async);
 
 	if (!priv->mapped_vma_count)
 		goto release_file;
@@ -536,6 +774,14 @@ static int do_map_vm(struct kvm *kvm, vm_map_info_t __user *user_info)
 	if (priv->vm_map_info.slot_count && copy_to_user(user_info_copied.slots, priv->vm_map_info.slots, sizeof(vm_memslot_t) * priv->vm_map_info.slot_count))
 		goto release_file;
 
+	// Queue before installing the fd, because userspace may close it right after
+	if (async) {
+		queue_work(system_unbound_wq, &priv->map_work);
+	} else {
+		priv->status->ready_slots = priv->vm_map_info.slot_count;
+		priv->status->done = 1;
+	}
+
 	fd_install(fd, file);
 
 	mmap_write_unlock(other_mm);
@@ -551,8 +797,10 @@ unlock_mem:
 put_fd:
 	put_unused_fd(fd);
 free_alloc:
-	if (priv)
+	if (priv) {
+		free_page((unsigned long)priv->status);
 		vfree(priv);
+	}
 do_return:
 	return -1;
 }
@@ -563,7 +811,9 @@ static long memflow_vm_ioctl(struct file *filp, unsigned int cmd, unsigned long
 		case MEMFLOW_VM_INFO:
 			return get_vm_info(filp->private_data, (vm_info_t __user *)argp);
 		case MEMFLOW_MAP_VM:
-			return do_map_vm(filp->private_data, (vm_map_info_t __user *)argp);
+			return do_map_vm(filp->private_data, (vm_map_info_t __user *)argp, false);
+		case MEMFLOW_MAP_VM_ASYNC:
+			return do_map_vm(filp->private_data, (vm_map_info_t __user *)argp, true);
 	}
 
 	return -1;
@@ -571,7 +821,73 @@ static long memflow_vm_ioctl(struct file *filp, unsigned int cmd, unsigned long
 
 static int memflow_vm_mapped_release(struct inode *inode, struct file *filp)
 {
-	vfree(filp->private_data);
+	struct vm_mapped_data *data = filp->private_data;
+
+	if (data->src_mm) {
+		atomic_set(&data->stop, 1);
+		flush_work(&data->map_work);
+		mmdrop(data->dst_mm);
+		mmdrop(data->src_mm);
+		put_task_struct(data->src_task);
+	}
+
+	free_page((unsigned long)data->status);
+	vfree(data);
 	return 0;
 }
 
+static int memflow_vm_mapped_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct vm_mapped_data *data = filp->private_data;
+
+	// Only the status page can be mapped, and only for reading
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE || vma->vm_flags & VM_WRITE)
+		return -EINVAL;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+	vma->vm_flags &= ~VM_MAYWRITE;
+#else
+	vm_flags_clear(vma, VM_MAYWRITE);
+#endif
+
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(data->status));
+}
+
+static __poll_t memflow_vm_mapped_poll(struct file *filp, poll_table *wait)
+{
+	struct vm_mapped_data *data = filp->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(filp, &data->map_wait, wait);
+
+	if (smp_load_acquire(&data->status->done)) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+		if (READ_ONCE(data->status->error))
+			mask |= EPOLLERR;
+	}
+
+	return mask;
+}
+
+static long memflow_vm_mapped_ioctl(struct file *filp, unsigned int cmd, unsigned long argp)
+{
+	struct vm_mapped_data *data = filp->private_data;
+	vm_map_status_t *status = data->status;
+	// MEMFLOW_MAP_WAIT passes the slot count by value
+	u32 slots = argp;
+
+	switch (cmd) {
+		case MEMFLOW_MAP_WAIT:
+			if (wait_event_interruptible(data->map_wait, smp_load_acquire(&status->ready_slots) >= slots || smp_load_acquire(&status->done)))
+				return -ERESTARTSYS;
+
+			if (smp_load_acquire(&status->ready_slots) >= slots)
+				return 0;
+
+			// Finished without reaching the slot - either failed, or the slot does not exist
+			return READ_ONCE(status->error) ? READ_ONCE(status->error) : -EINVAL;
+	}
+
+	return -1;
+}
+
@@ -16,9 +16,12 @@ fn main() {
         .allowlist_type("vm_memslot")
         .allowlist_type("vm_map_info")
         .allowlist_type("vm_info")
+        .allowlist_type("vm_map_status")
         .allowlist_var("IO_MEMFLOW_OPEN_VM")
         .allowlist_var("IO_MEMFLOW_VM_INFO")
         .allowlist_var("IO_MEMFLOW_MAP_VM")
+        .allowlist_var("IO_MEMFLOW_MAP_VM_ASYNC")
+        .allowlist_var("IO_MEMFLOW_MAP_WAIT")
         .generate()
         .expect("Unable to generate bindings");
 
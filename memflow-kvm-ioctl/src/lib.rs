@@ -6,13 +6,27 @@ include!(concat!(env!("OUT_DIR"), "/bindings.rs"));
 
 use std::fs::File;
 use std::os::unix::io::{AsRawFd, FromRawFd, RawFd};
+use std::sync::atomic::{AtomicU32, Ordering};
 
 // Do not depend on entire libc just for this function
 extern "C" {
     fn ioctl(fd: i32, request: __u64, ...) -> i32;
+    fn mmap(
+        addr: *mut std::os::raw::c_void,
+        len: usize,
+        prot: i32,
+        flags: i32,
+        fd: i32,
+        offset: i64,
+    ) -> *mut std::os::raw::c_void;
     fn munmap(addr: *mut std::os::raw::c_void, len: usize) -> i32;
+    fn sysconf(name: i32) -> std::os::raw::c_long;
 }
 
+const PROT_READ: i32 = 1;
+const MAP_SHARED: i32 = 1;
+const SC_PAGESIZE: i32 = 30;
+
 use std::io::Result;
 
 /// Structure assisting automatic memory map unmapping
@@ -21,6 +35,7 @@ use std::io::Result;
 /// or Rc for it to take place
 pub struct AutoMunmap {
     memslots: Vec<vm_memslot>,
+    status: Option<MapStatus>,
 }
 
 impl AutoMunmap {
@@ -31,12 +46,40 @@ impl AutoMunmap {
     /// Drop implementation of this structure calls munmap on all mapped memory regions.
     /// vm_memslots have to be correct for the runnings process, or causes undefined bahaviour.
     pub unsafe fn new(memslots: Vec<vm_memslot>) -> Self {
-        Self { memslots }
+        Self {
+            memslots,
+            status: None,
+        }
+    }
+
+    /// Create automatic unmapping of an asynchronously mapped VM
+    ///
+    /// # Safety
+    ///
+    /// Same as `new`. Additionally, `status` has to belong to the same mapping.
+    pub unsafe fn with_status(memslots: Vec<vm_memslot>, status: MapStatus) -> Self {
+        Self {
+            memslots,
+            status: Some(status),
+        }
+    }
+
+    /// Memory slots that are mapped into the current process
+    pub fn memslots(&self) -> &[vm_memslot] {
+        &self.memslots
+    }
+
+    /// Progress of the background mapping, if the VM was mapped asynchronously
+    pub fn status(&self) -> Option<&MapStatus> {
+        self.status.as_ref()
     }
 }
 
 impl Drop for AutoMunmap {
     fn drop(&mut self) {
+        // Stop the background mapping first
+        self.status.take();
+
         for slot in &self.memslots {
             unsafe {
                 munmap(slot.host_base as _, slot.map_size as _);
@@ -45,6 +88,118 @@ impl Drop for AutoMunmap {
     }
 }
 
+/// Progress of an asynchronous VM mapping
+///
+/// Holds the mapping file descriptor, and the status page shared with the kernel module. Memory slots
+/// get mapped in ascending guest physical address order, thus the first `ready_slots` slots returned by
+/// `VMHandle::map_vm_async` can be accessed. Accessing the other slots raises SIGBUS.
+///
+/// Dropping this structure stops the background mapping, if it is still in progress.
+pub struct MapStatus {
+    map: File,
+    status: *const vm_map_status,
+    page_size: usize,
+}
+
+// The status page is only ever read, with atomic loads
+unsafe impl Send for MapStatus {}
+unsafe impl Sync for MapStatus {}
+
+impl MapStatus {
+    unsafe fn from_raw_fd(map_fd: RawFd) -> Result<Self> {
+        let map = File::from_raw_fd(map_fd);
+        let page_size = sysconf(SC_PAGESIZE) as usize;
+
+        let status = mmap(
+            std::ptr::null_mut(),
+            page_size,
+            PROT_READ,
+            MAP_SHARED,
+            map.as_raw_fd(),
+            0,
+        );
+
+        if status as isize == -1 {
+            Err(std::io::Error::last_os_error())
+        } else {
+            Ok(Self {
+                map,
+                status: status as _,
+                page_size,
+            })
+        }
+    }
+
+    /// # Safety
+    ///
+    /// `field` has to point into the mapped status page. It must not be derived from a reference,
+    /// because the kernel modifies the page concurrently.
+    unsafe fn load(field: *const u32) -> u32 {
+        (*(field as *const AtomicU32)).load(Ordering::Acquire)
+    }
+
+    /// Number of memory slots, in mapping order, that are fully mapped in
+    pub fn ready_slots(&self) -> usize {
+        unsafe { Self::load(std::ptr::addr_of!((*self.status).ready_slots)) as usize }
+    }
+
+    /// Whether the background mapping has finished, successfully or not
+    pub fn done(&self) -> bool {
+        unsafe { Self::load(std::ptr::addr_of!((*self.status).done)) != 0 }
+    }
+
+    /// Error that stopped the background mapping, if any
+    pub fn error(&self) -> Option<std::io::Error> {
+        if !self.done() {
+            return None;
+        }
+
+        match unsafe { std::ptr::read_volatile(std::ptr::addr_of!((*self.status).error)) } {
+            0 => None,
+            e => Some(std::io::Error::from_raw_os_error(-e)),
+        }
+    }
+
+    /// Block until at least `slots` memory slots are mapped in
+    ///
+    /// Fails if the background mapping stopped before reaching them.
+    pub fn wait(&self, slots: usize) -> Result<()> {
+        while self.ready_slots() < slots {
+            // The slot count is passed by value
+            let ret = unsafe {
+                ioctl(
+                    self.map.as_raw_fd(),
+                    IO_MEMFLOW_MAP_WAIT as u64,
+                    slots as std::os::raw::c_ulong,
+                )
+            };
+
+            if ret < 0 {
+                let err = std::io::Error::last_os_error();
+                if err.kind() != std::io::ErrorKind::Interrupted {
+                    return Err(err);
+                }
+            }
+        }
+
+        Ok(())
+    }
+}
+
+impl AsRawFd for MapStatus {
+    fn as_raw_fd(&self) -> RawFd {
+        self.map.as_raw_fd()
+    }
+}
+
+impl Drop for MapStatus {
+    fn drop(&mut self) {
+        unsafe {
+            munmap(self.status as _, self.page_size);
+        }
+    }
+}
+
 /// Handle to memflow's kernel module
 ///
 /// This is a handle to `/dev/memflow`. It functions as a file, closes automatically when dropped
@@ -156,4 +311,41 @@ impl VMHandle {
             Ok(memslots)
         }
     }
+
+    /// Memory map the KVM instance asynchronously
+    ///
+    /// Same as `map_vm`, but returns as soon as address space is reserved for the memory slots. They get
+    /// mapped in the background, lowest guest physical addresses first. Use the returned `MapStatus` to
+    /// check, which slots are accessible.
+    pub fn map_vm_async(&self, slot_count: usize) -> Result<(Vec<vm_memslot>, MapStatus)> {
+        let mut vm_info = vm_map_info::default();
+        let mut memslots = vec![Default::default(); slot_count];
+
+        vm_info.slot_count = slot_count as u32;
+        vm_info.slots = memslots.as_mut_ptr();
+
+        let ret = unsafe {
+            ioctl(
+                self.vm.as_raw_fd(),
+                IO_MEMFLOW_MAP_VM_ASYNC as u64,
+                &mut vm_info,
+            )
+        };
+
+        if ret < 0 {
+            Err(std::io::Error::last_os_error())
+        } else {
+            memslots.truncate(vm_info.slot_count as usize);
+
+            match unsafe { MapStatus::from_raw_fd(ret) } {
+                Ok(status) => Ok((memslots, status)),
+                Err(e) => {
+                    // The map fd is already closed, which stops the background mapping, but the
+                    // reserved regions stay, until unmapped.
+                    drop(unsafe { AutoMunmap::new(memslots) });
+                    Err(e)
+                }
+            }
+        }
+    }
 }
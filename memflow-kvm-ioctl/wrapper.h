@@ -4,4 +4,6 @@
 const size_t IO_MEMFLOW_OPEN_VM = MEMFLOW_OPEN_VM;
 const size_t IO_MEMFLOW_VM_INFO = MEMFLOW_VM_INFO;
 const size_t IO_MEMFLOW_MAP_VM = MEMFLOW_MAP_VM;
+const size_t IO_MEMFLOW_MAP_VM_ASYNC = MEMFLOW_MAP_VM_ASYNC;
+const size_t IO_MEMFLOW_MAP_WAIT = MEMFLOW_MAP_WAIT;
 
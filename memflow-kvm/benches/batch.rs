@@ -0,0 +1,84 @@
+//! Sorted versus submission order batch copies
+//!
+//! Batches of page table entry, and page sized reads are scattered over a heap buffer standing in
+//! for the guest memory, which is large enough not to fit into the host cache. Every batch is
+//! copied both in submission order, and through `copy_sorted`, and the cost per request is
+//! reported.
+
+mod common;
+
+use common::Rng;
+use memflow_kvm::batch::{self, BatchEntry};
+
+/// Size of the synthetic guest memory
+const GUEST_SIZE: usize = 256 << 20;
+
+/// Number of requests copied for every measurement
+const TOTAL_REQUESTS: usize = 1 << 20;
+
+const BATCH_SIZES: [usize; 5] = [16, 64, 256, 1024, 4096];
+
+/// Generate a batch of scattered reads, with destinations laid out in submission order
+fn gen_batch(rng: &mut Rng, guest: &[u8], out: &mut [u8], size: usize) -> Vec<BatchEntry> {
+    let mut dst = out.as_mut_ptr() as usize;
+
+    (0..size)
+        .map(|_| {
+            let r = rng.next();
+            // Mostly page table entries, with every 8th request being a full page
+            let len = if r % 8 == 0 { 0x1000 } else { 8 };
+            let off = (r >> 16) as usize % (GUEST_SIZE / len) * len;
+            let entry = BatchEntry {
+                src: guest.as_ptr() as usize + off,
+                dst,
+                len,
+            };
+            dst += len;
+            entry
+        })
+        .collect()
+}
+
+fn run(batches: &[Vec<BatchEntry>], sorted: bool) {
+    let mut scratch = Vec::new();
+
+    for b in batches {
+        scratch.clear();
+        scratch.extend_from_slice(b);
+
+        if sorted {
+            unsafe { batch::copy_sorted(&mut scratch) };
+        } else {
+            for e in &scratch {
+                unsafe { batch::copy(e.src as *const u8, e.dst as *mut u8, e.len) };
+            }
+        }
+    }
+}
+
+fn main() {
+    let guest: Vec<u8> = (0..GUEST_SIZE).map(|i| i as u8).collect();
+    let mut rng = Rng::new(0x2545f4914f6cdd1d);
+
+    common::row(["batch", "in order", "sorted"]);
+
+    for size in BATCH_SIZES {
+        let count = TOTAL_REQUESTS / size;
+        // Destinations are reused by every batch, like the read buffers of a caller would be
+        let mut out = vec![0u8; size * 0x1000];
+        let batches: Vec<_> = (0..count)
+            .map(|_| gen_batch(&mut rng, &guest, &mut out, size))
+            .collect();
+
+        let (in_order, _) = common::measure(|| run(&batches, false));
+        let (sorted, _) = common::time(|| run(&batches, true));
+
+        common::row([
+            size.to_string(),
+            common::per_op(in_order, TOTAL_REQUESTS),
+            common::per_op(sorted, TOTAL_REQUESTS),
+        ]);
+
+        assert!(out.iter().any(|&b| b != 0));
+    }
+}
@@ -0,0 +1,55 @@
+//! Helpers shared by the benches
+//!
+//! The benches only use std, so that the crate does not need any dev-dependencies.
+
+// Not every bench uses every helper
+#![allow(dead_code)]
+
+use std::fmt::Display;
+use std::time::{Duration, Instant};
+
+/// Width of every column of the result tables
+const COLUMN_WIDTH: usize = 16;
+
+/// Xorshift generator, for reproducible synthetic layouts, and access patterns
+pub struct Rng(u64);
+
+impl Rng {
+    pub fn new(seed: u64) -> Self {
+        Self(seed | 1)
+    }
+
+    pub fn next(&mut self) -> u64 {
+        self.0 ^= self.0 << 13;
+        self.0 ^= self.0 >> 7;
+        self.0 ^= self.0 << 17;
+        self.0
+    }
+}
+
+/// Time a single run of `f`
+pub fn time<T>(f: impl FnOnce() -> T) -> (Duration, T) {
+    let start = Instant::now();
+    let ret = f();
+    (start.elapsed(), ret)
+}
+
+/// Run `f` once to warm up the caches, and the page tables of the buffers, then time another run
+pub fn measure<T>(mut f: impl FnMut() -> T) -> (Duration, T) {
+    f();
+    time(f)
+}
+
+/// Nanoseconds per operation
+pub fn per_op(d: Duration, ops: usize) -> String {
+    format!("{:.2} ns", d.as_nanos() as f64 / ops as f64)
+}
+
+/// Print a row of the result table
+pub fn row<I: Display>(cells: impl IntoIterator<Item = I>) {
+    let line = cells
+        .into_iter()
+        .map(|c| format!("{:>width$}", c.to_string(), width = COLUMN_WIDTH))
+        .collect::<String>();
+    println!("{}", line);
+}
@@ -0,0 +1,64 @@
+//! Streaming versus cached bulk copy throughput
+//!
+//! Copies a heap buffer standing in for the guest memory into a destination buffer, in chunks of
+//! various read sizes, both with `stream::copy`, and with a regular copy. After every pass, a small
+//! working set is walked again, to show how much of it the copy evicted from the cache. This is
+//! only an in-process approximation of the impact on a co-located guest.
+
+mod common;
+
+use memflow_kvm::stream;
+
+/// Size of the synthetic guest memory, and the destination buffer
+const BUFFER_SIZE: usize = 256 << 20;
+
+/// Size of the working set that is expected to stay in the cache
+const WORKING_SET: usize = 4 << 20;
+
+const READ_SIZES: [usize; 3] = [stream::STREAM_MIN, 2 << 20, 16 << 20];
+
+fn copy_all(src: &[u8], dst: &mut [u8], read_size: usize, streaming: bool) {
+    for (s, d) in src.chunks(read_size).zip(dst.chunks_mut(read_size)) {
+        if streaming {
+            unsafe { stream::copy(s.as_ptr(), d.as_mut_ptr(), s.len()) };
+        } else {
+            d.copy_from_slice(s);
+        }
+    }
+}
+
+/// Walk the working set, touching every cache line
+fn walk(set: &[u8]) -> u64 {
+    set.iter().step_by(64).fold(0u64, |sum, b| {
+        sum.wrapping_add(unsafe { std::ptr::read_volatile(b) } as u64)
+    })
+}
+
+fn main() {
+    let src: Vec<u8> = (0..BUFFER_SIZE).map(|i| i as u8).collect();
+    let mut dst = vec![0u8; BUFFER_SIZE];
+    let set: Vec<u8> = (0..WORKING_SET).map(|i| (i >> 6) as u8).collect();
+
+    common::row(["read size", "mode", "throughput", "working set"]);
+
+    for read_size in READ_SIZES {
+        for streaming in [false, true] {
+            // Warm up the destination, and bring the working set into the cache
+            copy_all(&src, &mut dst, read_size, streaming);
+            let (warm, _) = common::measure(|| walk(&set));
+
+            let (copy, _) = common::time(|| copy_all(&src, &mut dst, read_size, streaming));
+            let (after, sum) = common::time(|| walk(&set));
+
+            assert!(dst == src);
+            assert_ne!(sum, 0);
+
+            common::row([
+                format!("{} KiB", read_size >> 10),
+                (if streaming { "streaming" } else { "cached" }).to_string(),
+                format!("{:.2} GB/s", BUFFER_SIZE as f64 / copy.as_secs_f64() / 1e9),
+                format!("{} -> {} us", warm.as_micros(), after.as_micros()),
+            ]);
+        }
+    }
+}
@@ -0,0 +1,93 @@
+//! Per-read cost of guest physical address translation
+//!
+//! Builds a synthetic guest out of heap buffers, spread over the guest physical address space in
+//! 4, 16 and 64 memory slots, and performs page table entry sized reads at random addresses in
+//! them. Every read is resolved both through `TranslationTable`, and through a binary search over
+//! the sorted slots, the way a `MemoryMap` resolves it.
+
+mod common;
+
+use common::Rng;
+use memflow_kvm::translate::{TableSlot, TranslationTable};
+use memflow_kvm_ioctl::vm_memslot;
+
+/// Size of every memory slot
+const SLOT_SIZE: usize = 1 << 20;
+
+/// Number of reads for every measurement
+const READS: usize = 1 << 22;
+
+const SLOT_COUNTS: [usize; 3] = [4, 16, 64];
+
+fn search(slots: &[TableSlot], gpa: u64) -> Option<(usize, u64)> {
+    let idx = slots.partition_point(|s| s.base <= gpa).checked_sub(1)?;
+    let slot = &slots[idx];
+    let off = gpa - slot.base;
+
+    if off < slot.size {
+        Some((slot.host_base + off as usize, slot.size - off))
+    } else {
+        None
+    }
+}
+
+fn run(addrs: &[u64], translate: impl Fn(u64) -> Option<(usize, u64)>) -> u64 {
+    let mut sum = 0u64;
+
+    for &gpa in addrs {
+        let mut buf = [0u8; 8];
+        if let Some((host, avail)) = translate(gpa) {
+            if avail >= 8 {
+                unsafe { std::ptr::copy_nonoverlapping(host as *const u8, buf.as_mut_ptr(), 8) };
+            }
+        }
+        sum = sum.wrapping_add(u64::from_ne_bytes(buf));
+    }
+
+    sum
+}
+
+fn main() {
+    let mut rng = Rng::new(0x9e3779b97f4a7c15);
+
+    common::row(["slots", "table", "search"]);
+
+    for count in SLOT_COUNTS {
+        let buffers: Vec<Vec<u8>> = (0..count)
+            .map(|i| (0..SLOT_SIZE).map(|b| (b ^ i) as u8).collect())
+            .collect();
+
+        // Slots are 9 GiB plus a few pages apart, so that they are not aligned to any level of the
+        // table, and the layout with 64 of them spans multiple top level entries.
+        let memslots: Vec<_> = buffers
+            .iter()
+            .enumerate()
+            .map(|(i, buf)| vm_memslot {
+                base: i as u64 * ((9 << 30) + 0x5000) + 0x100000,
+                host_base: buf.as_ptr() as u64,
+                map_size: buf.len() as u64,
+            })
+            .collect();
+
+        let table = TranslationTable::new(&memslots);
+
+        let addrs: Vec<u64> = (0..READS)
+            .map(|_| {
+                let r = rng.next();
+                let slot = &memslots[r as usize % count];
+                slot.base + ((r >> 32) % (slot.map_size - 8) & !7)
+            })
+            .collect();
+
+        let (t_table, s_table) = common::measure(|| run(&addrs, |gpa| table.translate(gpa)));
+        let (t_search, s_search) = common::time(|| run(&addrs, |gpa| search(table.slots(), gpa)));
+
+        assert_eq!(s_table, s_search);
+
+        common::row([
+            count.to_string(),
+            common::per_op(t_table, READS),
+            common::per_op(t_search, READS),
+        ]);
+    }
+}
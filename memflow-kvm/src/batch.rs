@@ -0,0 +1,90 @@
+//! Batched physical memory copies
+//!
+//! Reads submitted by page table walks and OS layers are small, and scattered all over the guest.
+//! Servicing them in submission order means nearly every one of them misses the host cache and
+//! TLB. Instead, batches are sorted by host address, prefetched a few requests ahead, and requests
+//! that are contiguous both in the guest and in the destination are merged into a single copy.
+
+use std::ptr;
+
+/// Batches smaller than this are serviced in submission order
+pub const BATCH_MIN: usize = 16;
+
+/// Number of requests to prefetch ahead of the one being copied
+const PREFETCH_DISTANCE: usize = 8;
+
+/// A single request within a sorted batch
+#[derive(Clone, Copy, Debug)]
+pub struct BatchEntry {
+    /// Host address to copy from
+    pub src: usize,
+    /// Address of the destination buffer
+    pub dst: usize,
+    /// Number of bytes to copy
+    pub len: usize,
+}
+
+/// Copy `len` bytes from `src` to `dst`
+///
+/// Page table entry sized, and page sized copies are the overwhelming majority of requests, thus
+/// they are specialized so that the compiler can emit fixed length copies for them.
+///
+/// # Safety
+///
+/// Same as `ptr::copy_nonoverlapping`.
+#[inline(always)]
+pub unsafe fn copy(src: *const u8, dst: *mut u8, len: usize) {
+    match len {
+        8 => ptr::write_unaligned(dst as *mut u64, ptr::read_unaligned(src as *const u64)),
+        4 => ptr::write_unaligned(dst as *mut u32, ptr::read_unaligned(src as *const u32)),
+        0x1000 => ptr::copy_nonoverlapping(src, dst, 0x1000),
+        _ => ptr::copy_nonoverlapping(src, dst, len),
+    }
+}
+
+#[inline(always)]
+fn prefetch(addr: usize) {
+    #[cfg(target_arch = "x86_64")]
+    unsafe {
+        use std::arch::x86_64::{_mm_prefetch, _MM_HINT_T0};
+        _mm_prefetch::<_MM_HINT_T0>(addr as *const i8);
+    }
+    #[cfg(not(target_arch = "x86_64"))]
+    let _ = addr;
+}
+
+/// Perform all copies of a batch in host address order
+///
+/// # Safety
+///
+/// All entries have to describe valid, non-overlapping copies.
+pub unsafe fn copy_sorted(entries: &mut [BatchEntry]) {
+    entries.sort_unstable_by_key(|e| e.src);
+
+    for e in entries.iter().take(PREFETCH_DISTANCE) {
+        prefetch(e.src);
+    }
+
+    let mut i = 0;
+
+    while i < entries.len() {
+        let BatchEntry { src, dst, mut len } = entries[i];
+
+        // Merge runs that are contiguous both on the source, and destination sides
+        while let Some(next) = entries.get(i + 1) {
+            if next.src != src + len || next.dst != dst + len {
+                break;
+            }
+            len += next.len;
+            i += 1;
+        }
+
+        if let Some(e) = entries.get(i + PREFETCH_DISTANCE) {
+            prefetch(e.src);
+        }
+
+        copy(src as *const u8, dst as *mut u8, len);
+
+        i += 1;
+    }
+}
@@ -1,25 +1,50 @@
-use log::{debug, info};
+use log::{debug, error, info};
 
-use memflow::connector::MappedPhysicalMemory;
 use memflow::derive::connector;
 use memflow::error::*;
 use memflow::mem::MemoryMap;
 use memflow::plugins::ConnectorArgs;
+use memflow::prelude::v1::*;
 use memflow::types::{umem, Address};
 use memflow_kvm_ioctl::{AutoMunmap, VMHandle};
+use std::sync::atomic::{AtomicU64, Ordering};
 use std::sync::Arc;
+use std::time::Instant;
 
-pub type KVMConnector<'a> = MappedPhysicalMemory<&'a mut [u8], KVMMapData<&'a mut [u8]>>;
+// Copy kernels are only public for the benches
+#[doc(hidden)]
+pub mod batch;
+pub mod registry;
+pub mod scan;
+pub mod stats;
+#[doc(hidden)]
+pub mod stream;
+pub mod throttle;
+pub mod translate;
+use scan::{ScanChunk, ScanOptions};
+use stats::{Stats, StatsRecorder, StatsSnapshot};
+use throttle::{Throttle, ThrottleConfig};
+use translate::TranslationTable;
 
 pub struct KVMMapData<T> {
     handle: Arc<AutoMunmap>,
     mappings: MemoryMap<T>,
     addr_mappings: MemoryMap<(Address, umem)>,
+    table: Arc<TranslationTable>,
+    stats: Option<Arc<Stats>>,
+    throttle: Option<Arc<Throttle>>,
 }
 
 impl<'a> Clone for KVMMapData<&'a mut [u8]> {
     fn clone(&self) -> Self {
-        unsafe { Self::from_addrmap_mut(self.handle.clone(), self.addr_mappings.clone()) }
+        Self {
+            handle: self.handle.clone(),
+            mappings: unsafe { self.addr_mappings.clone().into_bufmap_mut() },
+            addr_mappings: self.addr_mappings.clone(),
+            table: self.table.clone(),
+            stats: self.stats.clone(),
+            throttle: self.throttle.clone(),
+        }
     }
 }
 
@@ -29,21 +54,675 @@ impl<T> AsRef<MemoryMap<T>> for KVMMapData<T> {
     }
 }
 
+impl<T> KVMMapData<T> {
+    /// Constant time guest physical to host address translation table
+    pub fn table(&self) -> &TranslationTable {
+        &self.table
+    }
+
+    /// Enable read and write instrumentation
+    ///
+    /// Statistics are shared by all connectors created out of this map data, and their clones.
+    pub fn with_stats(mut self) -> Self {
+        self.stats = Some(Arc::new(Stats::new(self.table.slots().len())));
+        self
+    }
+
+    /// Snapshot of the collected statistics, if instrumentation is enabled
+    pub fn stats(&self) -> Option<StatsSnapshot> {
+        self.stats.as_ref().map(|s| s.snapshot())
+    }
+
+    /// Limit the bandwidth, and the request rate of guest memory accesses
+    ///
+    /// The limits are shared by all connectors created out of this map data, and their clones.
+    pub fn with_throttle(mut self, config: ThrottleConfig) -> Self {
+        self.throttle = Some(Arc::new(Throttle::new(config)));
+        self
+    }
+
+    pub fn throttle(&self) -> Option<&Throttle> {
+        self.throttle.as_deref()
+    }
+
+    /// Number of memory slots, in guest physical address order, that are accessible
+    ///
+    /// This is all of them, unless the VM is being mapped asynchronously.
+    pub fn ready_slots(&self) -> usize {
+        self.handle
+            .status()
+            .map_or(self.handle.memslots().len(), |s| s.ready_slots())
+    }
+
+    /// Block until the first `count` memory slots are accessible
+    pub fn wait_slots(&self, count: usize) -> std::io::Result<()> {
+        match self.handle.status() {
+            Some(status) => status.wait(count),
+            None => Ok(()),
+        }
+    }
+}
+
 impl<'a> KVMMapData<&'a mut [u8]> {
-    unsafe fn from_addrmap_mut(handle: Arc<AutoMunmap>, map: MemoryMap<(Address, umem)>) -> Self {
+    unsafe fn from_shared(handle: Arc<AutoMunmap>, table: Arc<TranslationTable>) -> Self {
+        let mut map = MemoryMap::new();
+
+        for slot in handle.memslots() {
+            map.push_remap(
+                slot.base.into(),
+                slot.map_size as umem,
+                slot.host_base.into(),
+            );
+        }
+
         Self {
             handle,
             mappings: map.clone().into_bufmap_mut(),
             addr_mappings: map,
+            table,
+            stats: None,
+            throttle: None,
+        }
+    }
+}
+
+/// KVM physical memory connector
+///
+/// Reads and writes are resolved through the `TranslationTable` of the underlying `KVMMapData`,
+/// and copied straight from the memory mapping of the VM.
+#[derive(Clone)]
+pub struct KVMConnector<'a> {
+    map_data: KVMMapData<&'a mut [u8]>,
+    /// Scratch space of the sorted batch read path
+    batch: Vec<batch::BatchEntry>,
+    recorder: Option<StatsRecorder>,
+    /// Whether large reads use non-temporal copies
+    streaming: bool,
+    /// Number of memory slots known to be mapped in
+    ready_slots: usize,
+}
+
+impl<'a> KVMConnector<'a> {
+    pub fn with_map_data(map_data: KVMMapData<&'a mut [u8]>) -> Self {
+        Self {
+            recorder: map_data.stats.clone().map(StatsRecorder::new),
+            ready_slots: map_data.ready_slots(),
+            map_data,
+            batch: vec![],
+            streaming: false,
+        }
+    }
+
+    /// Enable, or disable streaming bulk reads
+    ///
+    /// When enabled, reads of at least 256 KiB are performed with non-temporal loads and stores,
+    /// so that large scans, and dumps do not evict the working set of the guest, and the host from
+    /// the shared cache.
+    pub fn set_streaming(&mut self, streaming: bool) {
+        self.streaming = streaming;
+    }
+
+    pub fn map_data(&self) -> &KVMMapData<&'a mut [u8]> {
+        &self.map_data
+    }
+
+    /// Snapshot of the statistics of this connector, and all of its clones
+    ///
+    /// Returns `None` if instrumentation is not enabled.
+    pub fn stats(&self) -> Option<StatsSnapshot> {
+        self.map_data.stats()
+    }
+
+    /// Views of all mapped memory slots, along with their guest physical base addresses
+    ///
+    /// The views point directly into the guest memory, nothing is copied. Note that the guest is
+    /// running, thus the contents may change underneath. Accesses through the views are not
+    /// recorded by instrumentation.
+    ///
+    /// If the VM is mapped asynchronously, this waits for the mapping to finish. If it fails, only
+    /// the slots that were mapped in are returned.
+    pub fn mapped_slots(&self) -> impl Iterator<Item = (Address, &[u8])> + '_ {
+        let memslots = self.map_data.handle.memslots();
+        let _ = self.map_data.wait_slots(memslots.len());
+        let limit = memslots
+            .get(self.map_data.ready_slots())
+            .map_or(u64::MAX, |s| s.base);
+
+        self.map_data
+            .table
+            .slots()
+            .iter()
+            .take_while(move |slot| slot.base < limit)
+            .map(|slot| {
+                (slot.base.into(), unsafe {
+                    std::slice::from_raw_parts(slot.host_base as *const u8, slot.size as usize)
+                })
+            })
+    }
+
+    /// Scan all mapped guest memory in parallel
+    ///
+    /// `callback` gets invoked on page aligned chunks of guest memory, from multiple threads at
+    /// once. Returning `false` from it stops the scan. See [`scan::scan`] for details.
+    ///
+    /// If the VM is mapped asynchronously, this waits for the mapping to finish first.
+    ///
+    /// With instrumentation enabled, the scanned bytes are recorded as reads of their slots. Bytes
+    /// that chunks overlap with the next one are only counted once. The recorder of a connector
+    /// only allows a single writer, thus the scan borrows the connector mutably - clone it to scan
+    /// from multiple threads.
+    ///
+    /// Returns `false` if the scan was stopped by the callback, or the VM could not be mapped in.
+    pub fn scan<F>(&mut self, opts: ScanOptions, callback: F) -> bool
+    where
+        F: Fn(&ScanChunk) -> bool + Sync,
+    {
+        if let Err(e) = self
+            .map_data
+            .wait_slots(self.map_data.handle.memslots().len())
+        {
+            error!("unable to scan, the vm could not be mapped in: {}", e);
+            return false;
+        }
+
+        let table = &*self.map_data.table;
+        let throttle = self.map_data.throttle();
+
+        // Workers run concurrently, while the recorder only allows a single writer. Sum up the
+        // scanned bytes per slot, and record them once the scan is over.
+        let scanned = match self.recorder {
+            Some(_) => table.slots().iter().map(|_| AtomicU64::new(0)).collect(),
+            None => vec![],
+        };
+
+        // The mapping is kept alive by the handle in `map_data`
+        let ret = unsafe {
+            scan::scan(table, opts, |chunk| {
+                if let Some(throttle) = throttle {
+                    throttle.acquire(chunk.data.len() as u64, 1);
+                }
+                if let Some(bytes) = table
+                    .lookup(chunk.address.to_umem())
+                    .and_then(|(id, _)| scanned.get(id))
+                {
+                    bytes.fetch_add(chunk.owned as u64, Ordering::Relaxed);
+                }
+                callback(chunk)
+            })
+        };
+
+        if let Some(stats) = &self.recorder {
+            for (slot, bytes) in table.slots().iter().zip(&scanned) {
+                match bytes.load(Ordering::Relaxed) {
+                    0 => {}
+                    bytes => stats.record_read(table, slot.base, bytes as usize),
+                }
+            }
+        }
+
+        ret
+    }
+}
+
+/// Copy `len` bytes out of the guest memory
+#[inline(always)]
+unsafe fn copy_from_guest(streaming: bool, src: usize, dst: *mut u8, len: usize) {
+    if streaming && len >= stream::STREAM_MIN {
+        stream::copy(src as *const u8, dst, len)
+    } else {
+        batch::copy(src as *const u8, dst, len)
+    }
+}
+
+/// Make sure that all memory slots below `end` are accessible
+///
+/// This is a single comparison, unless the VM is still being mapped in asynchronously.
+#[inline(always)]
+fn ensure_mapped<T>(map_data: &KVMMapData<T>, ready_slots: &mut usize, end: umem) -> Result<()> {
+    if *ready_slots < map_data.handle.memslots().len() {
+        wait_mapped(map_data, ready_slots, end)
+    } else {
+        Ok(())
+    }
+}
+
+#[cold]
+fn wait_mapped<T>(map_data: &KVMMapData<T>, ready_slots: &mut usize, end: umem) -> Result<()> {
+    // Slots are mapped in ascending address order, wait for all of them up to `end`
+    let needed = map_data
+        .handle
+        .memslots()
+        .partition_point(|s| (s.base as umem) < end);
+
+    if needed > *ready_slots {
+        map_data.wait_slots(needed).map_err(|e| {
+            Error(ErrorOrigin::Connector, ErrorKind::UnableToReadMemory)
+                .log_error(format!("The memory slot could not be mapped in: {}", e))
+        })?;
+        *ready_slots = map_data.ready_slots();
+    }
+
+    Ok(())
+}
+
+/// Guest physical address, and length of a read request
+#[inline(always)]
+fn request_range(
+    CTup3(addr, _, buf): &CTup3<PhysicalAddress, Address, CSliceMut<'_, u8>>,
+) -> (umem, usize) {
+    (Address::from(*addr).to_umem(), buf.len())
+}
+
+/// Throttle a batch of `(address, length)` requests, and make sure the memory they touch is
+/// mapped in
+#[inline(always)]
+fn admit<T>(
+    map_data: &KVMMapData<T>,
+    ready_slots: &mut usize,
+    reqs: impl Iterator<Item = (umem, usize)> + Clone,
+) -> Result<()> {
+    if let Some(throttle) = map_data.throttle() {
+        let (bytes, count) = reqs.clone().fold((0, 0), |(bytes, count), (_, len)| {
+            (bytes + len as u64, count + 1)
+        });
+        throttle.acquire(bytes, count);
+    }
+
+    let end = reqs
+        .map(|(addr, len)| addr.saturating_add(len as umem))
+        .max()
+        .unwrap_or_default();
+
+    ensure_mapped(map_data, ready_slots, end)
+}
+
+/// Read a single request, splitting it up across slots, and holes in between them
+fn read_one<'a>(
+    table: &TranslationTable,
+    stats: Option<&StatsRecorder>,
+    streaming: bool,
+    CTup3(addr, meta_addr, mut buf): CTup3<PhysicalAddress, Address, CSliceMut<'a, u8>>,
+    mut out: Option<&mut OpaqueCallback<CTup2<Address, CSliceMut<'a, u8>>>>,
+    mut out_fail: Option<&mut OpaqueCallback<CTup2<Address, CSliceMut<'a, u8>>>>,
+) {
+    let mut addr = Address::from(addr).to_umem();
+
+    if let Some(stats) = stats {
+        stats.record_request(false, buf.len());
+    }
+
+    // Fast path - the entire read is within a single slot
+    if let Some((host, avail)) = table.translate(addr) {
+        if buf.len() as umem <= avail {
+            unsafe { copy_from_guest(streaming, host, buf.as_mut_ptr(), buf.len()) };
+            if let Some(stats) = stats {
+                stats.record_read(table, addr, buf.len());
+            }
+            opt_call(out, CTup2(meta_addr, buf));
+            return;
         }
     }
+
+    let mut meta_addr = meta_addr.to_umem();
+    let mut buf: &mut [u8] = buf.into();
+
+    while !buf.is_empty() {
+        let translated = table.translate(addr);
+
+        let len = match translated {
+            Some((_, avail)) => avail,
+            None => table
+                .next_mapped(addr)
+                .map(|n| n - addr)
+                .unwrap_or(umem::MAX),
+        }
+        .min(buf.len() as umem) as usize;
+
+        let (head, tail) = std::mem::take(&mut buf).split_at_mut(len);
+
+        if let Some((host, _)) = translated {
+            unsafe { copy_from_guest(streaming, host, head.as_mut_ptr(), len) };
+            if let Some(stats) = stats {
+                stats.record_read(table, addr, len);
+            }
+            opt_call(out.as_deref_mut(), CTup2(meta_addr.into(), head.into()));
+        } else {
+            if let Some(stats) = stats {
+                stats.record_hole(len);
+            }
+            opt_call(
+                out_fail.as_deref_mut(),
+                CTup2(meta_addr.into(), head.into()),
+            );
+        }
+
+        buf = tail;
+        addr += len as umem;
+        meta_addr += len as umem;
+    }
+}
+
+impl<'a> PhysicalMemory for KVMConnector<'a> {
+    fn phys_read_raw_iter(
+        &mut self,
+        MemOps {
+            mut inp,
+            mut out,
+            mut out_fail,
+        }: PhysicalReadMemOps,
+    ) -> Result<()> {
+        let table = &*self.map_data.table;
+        let stats = self.recorder.as_ref();
+        let start = stats.map(|_| Instant::now());
+
+        // Single reads are by far the most common, do not allocate anything for them
+        let first = match inp.next() {
+            Some(first) => first,
+            None => return Ok(()),
+        };
+
+        let second = match inp.next() {
+            Some(second) => second,
+            None => {
+                admit(
+                    &self.map_data,
+                    &mut self.ready_slots,
+                    std::iter::once(request_range(&first)),
+                )?;
+                read_one(table, stats, self.streaming, first, out, out_fail);
+                if let (Some(stats), Some(start)) = (stats, start) {
+                    stats.record_batch(start.elapsed());
+                }
+                return Ok(());
+            }
+        };
+
+        // Batches smaller than `BATCH_MIN` are serviced in submission order straight off the
+        // stack. Only larger ones get collected, and sorted.
+        let mut head: [Option<_>; batch::BATCH_MIN] = Default::default();
+        head[0] = Some(first);
+        head[1] = Some(second);
+        let mut count = 2;
+
+        while count < batch::BATCH_MIN {
+            match inp.next() {
+                Some(req) => head[count] = Some(req),
+                None => break,
+            }
+            count += 1;
+        }
+
+        if count < batch::BATCH_MIN {
+            let head = &mut head[..count];
+
+            admit(
+                &self.map_data,
+                &mut self.ready_slots,
+                head.iter().flatten().map(request_range),
+            )?;
+
+            for req in head.iter_mut().filter_map(Option::take) {
+                read_one(
+                    table,
+                    stats,
+                    self.streaming,
+                    req,
+                    out.as_deref_mut(),
+                    out_fail.as_deref_mut(),
+                );
+            }
+
+            if let (Some(stats), Some(start)) = (stats, start) {
+                stats.record_batch(start.elapsed());
+            }
+
+            return Ok(());
+        }
+
+        let mut reqs = Vec::with_capacity(batch::BATCH_MIN * 2);
+        reqs.extend(
+            head.iter_mut()
+                .filter_map(Option::take)
+                .map(|req| (req, false)),
+        );
+        reqs.extend(inp.map(|req| (req, false)));
+
+        admit(
+            &self.map_data,
+            &mut self.ready_slots,
+            reqs.iter().map(|(req, _)| request_range(req)),
+        )?;
+
+        let entries = &mut self.batch;
+        entries.clear();
+
+        for (CTup3(addr, _, buf), copied) in reqs.iter_mut() {
+            if let Some((host, avail)) = table.translate(Address::from(*addr).to_umem()) {
+                // Bulk reads are left out, so that they can be streamed
+                if buf.len() as umem <= avail
+                    && !(self.streaming && buf.len() >= stream::STREAM_MIN)
+                {
+                    entries.push(batch::BatchEntry {
+                        src: host,
+                        dst: buf.as_mut_ptr() as usize,
+                        len: buf.len(),
+                    });
+                    *copied = true;
+                }
+            }
+        }
+
+        unsafe { batch::copy_sorted(entries) };
+
+        // Report results in submission order. Requests that did not fit into a single slot are
+        // only copied now.
+        for (req, copied) in reqs {
+            if copied {
+                let CTup3(addr, meta_addr, buf) = req;
+                if let Some(stats) = stats {
+                    stats.record_request(false, buf.len());
+                    stats.record_read(table, Address::from(addr).to_umem(), buf.len());
+                }
+                opt_call(out.as_deref_mut(), CTup2(meta_addr, buf));
+            } else {
+                read_one(
+                    table,
+                    stats,
+                    self.streaming,
+                    req,
+                    out.as_deref_mut(),
+                    out_fail.as_deref_mut(),
+                );
+            }
+        }
+
+        if let (Some(stats), Some(start)) = (stats, start) {
+            stats.record_batch(start.elapsed());
+        }
+
+        Ok(())
+    }
+
+    fn phys_write_raw_iter(
+        &mut self,
+        MemOps {
+            inp,
+            mut out,
+            mut out_fail,
+        }: PhysicalWriteMemOps,
+    ) -> Result<()> {
+        let table = &*self.map_data.table;
+        let stats = self.recorder.as_ref();
+        let start = stats.map(|_| Instant::now());
+
+        for CTup3(addr, meta_addr, buf) in inp {
+            let mut addr = Address::from(addr).to_umem();
+
+            admit(
+                &self.map_data,
+                &mut self.ready_slots,
+                std::iter::once((addr, buf.len())),
+            )?;
+
+            if let Some(stats) = stats {
+                stats.record_request(true, buf.len());
+            }
+
+            if let Some((host, avail)) = table.translate(addr) {
+                if buf.len() as umem <= avail {
+                    unsafe { batch::copy(buf.as_ptr(), host as *mut u8, buf.len()) };
+                    if let Some(stats) = stats {
+                        stats.record_write(table, addr, buf.len());
+                    }
+                    opt_call(out.as_deref_mut(), CTup2(meta_addr, buf));
+                    continue;
+                }
+            }
+
+            let mut meta_addr = meta_addr.to_umem();
+            let mut buf: &[u8] = buf.into();
+
+            while !buf.is_empty() {
+                let translated = table.translate(addr);
+
+                let len = match translated {
+                    Some((_, avail)) => avail,
+                    None => table
+                        .next_mapped(addr)
+                        .map(|n| n - addr)
+                        .unwrap_or(umem::MAX),
+                }
+                .min(buf.len() as umem) as usize;
+
+                let (head, tail) = buf.split_at(len);
+
+                if let Some((host, _)) = translated {
+                    unsafe { batch::copy(head.as_ptr(), host as *mut u8, len) };
+                    if let Some(stats) = stats {
+                        stats.record_write(table, addr, len);
+                    }
+                    opt_call(out.as_deref_mut(), CTup2(meta_addr.into(), head.into()));
+                } else {
+                    if let Some(stats) = stats {
+                        stats.record_hole(len);
+                    }
+                    opt_call(
+                        out_fail.as_deref_mut(),
+                        CTup2(meta_addr.into(), head.into()),
+                    );
+                }
+
+                buf = tail;
+                addr += len as umem;
+                meta_addr += len as umem;
+            }
+        }
+
+        if let (Some(stats), Some(start)) = (stats, start) {
+            stats.record_batch(start.elapsed());
+        }
+
+        Ok(())
+    }
+
+    fn metadata(&self) -> PhysicalMemoryMetadata {
+        let table = &self.map_data.table;
+
+        PhysicalMemoryMetadata {
+            max_address: table.max_address().into(),
+            real_size: table.real_size(),
+            readonly: false,
+            ideal_batch_size: u32::MAX,
+        }
+    }
+}
+
+/// Parse an optional boolean connector argument
+fn parse_flag(args: &ConnectorArgs, name: &str) -> Result<bool> {
+    match args.extra_args.get(name) {
+        None | Some("0") | Some("false") | Some("off") => Ok(false),
+        Some("1") | Some("true") | Some("on") => Ok(true),
+        Some(_) => Err(
+            Error(ErrorOrigin::Connector, ErrorKind::ArgValidation).log_error(format!(
+                "`{}` has to be one of: 0, 1, false, true, off, on",
+                name
+            )),
+        ),
+    }
+}
+
+/// Parse an optional rate connector argument, with an optional `k`, `m`, or `g` binary suffix
+fn parse_rate(args: &ConnectorArgs, name: &str) -> Result<u64> {
+    let value = match args.extra_args.get(name) {
+        Some(value) => value.to_ascii_lowercase(),
+        None => return Ok(0),
+    };
+
+    let (digits, shift) = match value.as_bytes().last() {
+        Some(b'k') => (&value[..value.len() - 1], 10),
+        Some(b'm') => (&value[..value.len() - 1], 20),
+        Some(b'g') => (&value[..value.len() - 1], 30),
+        _ => (&value[..], 0),
+    };
+
+    digits
+        .parse::<u64>()
+        .ok()
+        .and_then(|v| v.checked_mul(1 << shift))
+        .ok_or_else(|| {
+            Error(ErrorOrigin::Connector, ErrorKind::ArgValidation).log_error(format!(
+                "`{}` has to be a number, optionally followed by k, m, or g",
+                name
+            ))
+        })
+}
+
+/// Parse the throttling connector arguments
+fn parse_throttle(args: &ConnectorArgs) -> Result<Option<ThrottleConfig>> {
+    let psi_threshold = match args.extra_args.get("psi") {
+        Some(psi) => {
+            let threshold = psi
+                .parse::<f64>()
+                .ok()
+                .filter(|p| *p >= 0.0)
+                .ok_or_else(|| {
+                    Error(ErrorOrigin::Connector, ErrorKind::ArgValidation)
+                        .log_error("`psi` has to be a non-negative percentage")
+                })?;
+
+            // Otherwise, pressure adaptation would be silently off
+            throttle::memory_pressure().map_err(|e| {
+                Error(ErrorOrigin::Connector, ErrorKind::ArgValidation).log_error(format!(
+                    "`psi` requires host memory pressure stall information: {}",
+                    e
+                ))
+            })?;
+
+            Some(threshold)
+        }
+        None => None,
+    };
+
+    let config = ThrottleConfig {
+        bytes_per_sec: parse_rate(args, "bps")?,
+        requests_per_sec: parse_rate(args, "rps")?,
+        psi_threshold,
+    };
+
+    if config.bytes_per_sec == 0 && config.requests_per_sec == 0 {
+        if config.psi_threshold.is_some() {
+            return Err(Error(ErrorOrigin::Connector, ErrorKind::ArgValidation)
+                .log_error("`psi` requires `bps`, or `rps` to be set"));
+        }
+        return Ok(None);
+    }
+
+    Ok(Some(config))
 }
 
 /// Creates a new KVM Connector instance.
 #[connector(name = "kvm")]
-pub fn create_connector<'a>(
-    args: &ConnectorArgs,
-) -> Result<MappedPhysicalMemory<&'a mut [u8], KVMMapData<&'a mut [u8]>>> {
+pub fn create_connector<'a>(args: &ConnectorArgs) -> Result<KVMConnector<'a>> {
     const ERROR_UNABLE_TO_READ_MEMORY: &str = "Could not access the memflow device at /dev/memflow. Please make sure that you installed the dkms module properly and that it is loaded via `modprobe memflow`. Also ensure that you have read and write access to /dev/memflow. For further information check the readme at https://github.com/memflow/memflow-kvm";
 
     let pid = match &args.target {
@@ -55,6 +734,11 @@ pub fn create_connector<'a>(
         None => None,
     };
 
+    let stats = parse_flag(args, "stats")?;
+    let streaming = parse_flag(args, "streaming")?;
+    let throttle = parse_throttle(args)?;
+    let async_map = parse_flag(args, "async_map")?;
+
     let vm = VMHandle::try_open(pid).map_err(|_| {
         Error(ErrorOrigin::Connector, ErrorKind::UnableToReadMemory)
             .log_error(ERROR_UNABLE_TO_READ_MEMORY)
@@ -73,36 +757,60 @@ pub fn create_connector<'a>(
             slot.host_base + slot.map_size
         );
     }
-    let mapped_memslots = vm.map_vm(64).map_err(|e| {
-        Error(ErrorOrigin::Connector, ErrorKind::UnableToMapFile).log_error(format!(
-            "The mapped memory slots for the vm could not be read: {}",
-            e
-        ))
-    })?;
+    let (munmap, table) = registry::get_or_map(pid, &memslots, || {
+        let mapped = if async_map {
+            vm.map_vm_async(64)
+                .map(|(slots, status)| (slots, Some(status)))
+        } else {
+            vm.map_vm(64).map(|slots| (slots, None))
+        };
 
-    let mut mem_map = MemoryMap::new();
+        let (mapped_memslots, status) = mapped.map_err(|e| {
+            Error(ErrorOrigin::Connector, ErrorKind::UnableToMapFile).log_error(format!(
+                "The mapped memory slots for the vm could not be read: {}",
+                e
+            ))
+        })?;
 
-    info!("mmapped {} slots", mapped_memslots.len());
-    for slot in mapped_memslots.iter() {
-        debug!(
-            "{:x}-{:x} -> {:x}-{:x}",
-            slot.base,
-            slot.base + slot.map_size,
-            slot.host_base,
-            slot.host_base + slot.map_size
-        );
-        mem_map.push_remap(
-            slot.base.into(),
-            slot.map_size as umem,
-            slot.host_base.into(),
-        );
+        if status.is_some() {
+            info!("mmapping {} slots in the background", mapped_memslots.len());
+        } else {
+            info!("mmapped {} slots", mapped_memslots.len());
+        }
+        for slot in mapped_memslots.iter() {
+            debug!(
+                "{:x}-{:x} -> {:x}-{:x}",
+                slot.base,
+                slot.base + slot.map_size,
+                slot.host_base,
+                slot.host_base + slot.map_size
+            );
+        }
+
+        Ok(Arc::new(unsafe {
+            match status {
+                Some(status) => AutoMunmap::with_status(mapped_memslots, status),
+                None => AutoMunmap::new(mapped_memslots),
+            }
+        }))
+    })?;
+
+    if Arc::strong_count(&munmap) > 1 {
+        info!("reusing existing mapping of the vm with pid={}", pid);
     }
 
-    let munmap = Arc::new(unsafe { AutoMunmap::new(mapped_memslots) });
+    let mut map_data = unsafe { KVMMapData::from_shared(munmap, table) };
 
-    let map_data = unsafe { KVMMapData::from_addrmap_mut(munmap, mem_map) };
+    if stats {
+        map_data = map_data.with_stats();
+    }
+
+    if let Some(config) = throttle {
+        map_data = map_data.with_throttle(config);
+    }
 
-    let mem = MappedPhysicalMemory::with_info(map_data);
+    let mut connector = KVMConnector::with_map_data(map_data);
+    connector.set_streaming(streaming);
 
-    Ok(mem)
+    Ok(connector)
 }
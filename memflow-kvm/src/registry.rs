@@ -0,0 +1,108 @@
+//! Process-wide registry of mapped VMs
+//!
+//! Mapping a VM pins, and remaps all of its memory, which may take seconds for large guests. When
+//! multiple connectors get created for the same VM, they all share a single mapping, as long as the
+//! memory layout of the VM did not change in between.
+//!
+//! The registry does not keep mappings alive on its own - once the last connector using a mapping
+//! is dropped, the VM gets unmapped, and the next connector maps it again.
+
+use crate::translate::TranslationTable;
+use memflow_kvm_ioctl::{vm_memslot, AutoMunmap};
+use std::sync::{Arc, Mutex, MutexGuard, Weak};
+
+/// Mapping of a VM, shared by all connectors created for it
+#[derive(Default)]
+struct Shared {
+    handle: Weak<AutoMunmap>,
+    table: Weak<TranslationTable>,
+}
+
+impl Shared {
+    fn upgrade(&self) -> Option<(Arc<AutoMunmap>, Arc<TranslationTable>)> {
+        Some((self.handle.upgrade()?, self.table.upgrade()?))
+    }
+}
+
+struct RegistryEntry {
+    pid: i32,
+    /// Memory layout of the VM (in its userspace) at the time of mapping
+    layout: Vec<vm_memslot>,
+    /// Stays locked while the VM is being mapped in
+    shared: Arc<Mutex<Shared>>,
+}
+
+impl RegistryEntry {
+    fn matches(&self, pid: i32, layout: &[vm_memslot]) -> bool {
+        self.pid == pid
+            && self.layout.len() == layout.len()
+            && self.layout.iter().zip(layout).all(|(a, b)| {
+                (a.base, a.host_base, a.map_size) == (b.base, b.host_base, b.map_size)
+            })
+    }
+
+    /// Whether the entry is being mapped in, or its mapping is still in use
+    fn in_use(&self) -> bool {
+        // Other references to `shared` are only ever taken while the registry is locked
+        Arc::strong_count(&self.shared) > 1 || lock(&self.shared).handle.strong_count() > 0
+    }
+}
+
+static REGISTRY: Mutex<Vec<RegistryEntry>> = Mutex::new(Vec::new());
+
+fn lock<T>(mutex: &Mutex<T>) -> MutexGuard<'_, T> {
+    mutex.lock().unwrap_or_else(|e| e.into_inner())
+}
+
+/// Retrieve an existing mapping of the VM, or create a new one
+///
+/// # Arguments
+///
+/// * `pid` - PID of the VM monitor
+/// * `layout` - memory slots of the VM, as returned by `VMHandle::info`
+/// * `map` - maps the VM in, if no mapping with the same layout exists
+///
+/// Only the requests for the same VM, and layout wait for each other while `map` is executing,
+/// thus the VM will not be mapped twice, while different VMs may be mapped in concurrently. If
+/// `map` fails, the next waiting request attempts to map the VM again.
+pub fn get_or_map<E>(
+    pid: i32,
+    layout: &[vm_memslot],
+    map: impl FnOnce() -> Result<Arc<AutoMunmap>, E>,
+) -> Result<(Arc<AutoMunmap>, Arc<TranslationTable>), E> {
+    let shared = {
+        let mut registry = lock(&REGISTRY);
+
+        // Drop the entries that are no longer in use, or whose VM layout has changed
+        registry.retain(|e| e.in_use() && (e.pid != pid || e.matches(pid, layout)));
+
+        match registry.iter().find(|e| e.matches(pid, layout)) {
+            Some(entry) => entry.shared.clone(),
+            None => {
+                let shared = Arc::new(Mutex::new(Shared::default()));
+                registry.push(RegistryEntry {
+                    pid,
+                    layout: layout.to_vec(),
+                    shared: shared.clone(),
+                });
+                shared
+            }
+        }
+    };
+
+    let mut shared = lock(&shared);
+
+    if let Some(mapped) = shared.upgrade() {
+        return Ok(mapped);
+    }
+
+    let handle = map()?;
+    let table = Arc::new(TranslationTable::new(handle.memslots()));
+
+    *shared = Shared {
+        handle: Arc::downgrade(&handle),
+        table: Arc::downgrade(&table),
+    };
+
+    Ok((handle, table))
+}
@@ -0,0 +1,241 @@
+//! Parallel scanning of the mapped guest memory
+//!
+//! The entire guest is already mapped into the current process, so there is no need to copy it
+//! through intermediate buffers just to search it. The scanner splits every mapped slot into page
+//! aligned chunks, and hands out views of them to a pool of worker threads. Workers claim chunks
+//! one by one, so faster threads naturally pick up the work of slower ones.
+
+use crate::translate::TranslationTable;
+use memflow::types::Address;
+use std::num::NonZeroUsize;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+
+const PAGE_SIZE: usize = 0x1000;
+
+/// Configuration of a memory scan
+#[derive(Clone, Copy, Debug)]
+pub struct ScanOptions {
+    /// Size of a single unit of work. Rounded up to the page size.
+    pub chunk_size: usize,
+    /// Number of bytes every chunk extends into the next one
+    ///
+    /// Set this to at least the length of the searched pattern minus one, so that patterns
+    /// crossing chunk boundaries are not missed.
+    pub overlap: usize,
+    /// Number of worker threads. 0 uses all available cores.
+    pub threads: usize,
+}
+
+impl Default for ScanOptions {
+    fn default() -> Self {
+        Self {
+            chunk_size: 0x200000,
+            overlap: 0,
+            threads: 0,
+        }
+    }
+}
+
+/// A single chunk of guest memory being scanned
+#[derive(Clone, Copy, Debug)]
+pub struct ScanChunk<'a> {
+    /// Guest physical address of the first byte of `data`
+    pub address: Address,
+    /// View of the guest memory, including the overlap with the next chunk
+    pub data: &'a [u8],
+    /// Number of leading bytes of `data` that belong to this chunk
+    ///
+    /// Bytes past this point are also covered by the next chunk. To avoid reporting a match twice,
+    /// only consider matches that start before `owned`.
+    pub owned: usize,
+}
+
+/// Scan all mapped memory described by `table`
+///
+/// `callback` is invoked on every chunk of memory, from multiple threads at once. Returning
+/// `false` from the callback stops the scan early. Chunks never cross slot boundaries.
+///
+/// Returns `false` if the scan was stopped by the callback.
+///
+/// # Safety
+///
+/// The memory described by the table has to stay mapped for the duration of the call. The guest
+/// is still running, thus memory may change while it is being observed.
+pub unsafe fn scan<F>(table: &TranslationTable, opts: ScanOptions, callback: F) -> bool
+where
+    F: Fn(&ScanChunk) -> bool + Sync,
+{
+    let chunk_size = opts.chunk_size.max(1).saturating_add(PAGE_SIZE - 1) & !(PAGE_SIZE - 1);
+    let slots = table.slots();
+
+    // Index of the first chunk of every slot, followed by the total chunk count
+    let mut chunk_starts = Vec::with_capacity(slots.len() + 1);
+    let mut total = 0;
+
+    for slot in slots {
+        chunk_starts.push(total);
+        total += (slot.size as usize + chunk_size - 1) / chunk_size;
+    }
+
+    chunk_starts.push(total);
+
+    let next_chunk = AtomicUsize::new(0);
+    let stopped = AtomicBool::new(false);
+
+    let worker = || {
+        while !stopped.load(Ordering::Relaxed) {
+            let idx = next_chunk.fetch_add(1, Ordering::Relaxed);
+
+            if idx >= total {
+                break;
+            }
+
+            let slot_idx = chunk_starts.partition_point(|&s| s <= idx) - 1;
+            let slot = &slots[slot_idx];
+            let slot_size = slot.size as usize;
+
+            let off = (idx - chunk_starts[slot_idx]) * chunk_size;
+            let owned = chunk_size.min(slot_size - off);
+            let len = owned.saturating_add(opts.overlap).min(slot_size - off);
+
+            let chunk = ScanChunk {
+                address: Address::from(slot.base + off as u64),
+                data: std::slice::from_raw_parts((slot.host_base + off) as *const u8, len),
+                owned,
+            };
+
+            if !callback(&chunk) {
+                stopped.store(true, Ordering::Relaxed);
+            }
+        }
+    };
+
+    let threads = match opts.threads {
+        0 => std::thread::available_parallelism().map_or(1, NonZeroUsize::get),
+        n => n,
+    }
+    .min(total.max(1));
+
+    std::thread::scope(|s| {
+        for _ in 1..threads {
+            s.spawn(worker);
+        }
+        worker();
+    });
+
+    !stopped.load(Ordering::Relaxed)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use memflow_kvm_ioctl::vm_memslot;
+    use std::sync::Mutex;
+
+    /// Chunk as seen by the callback - address, host address of the data, length, and owned bytes
+    type Seen = (u64, usize, usize, usize);
+
+    fn scan_all(table: &TranslationTable, opts: ScanOptions) -> Vec<Seen> {
+        let seen = Mutex::new(vec![]);
+
+        let finished = unsafe {
+            scan(table, opts, |chunk| {
+                seen.lock().unwrap().push((
+                    chunk.address.to_umem(),
+                    chunk.data.as_ptr() as usize,
+                    chunk.data.len(),
+                    chunk.owned,
+                ));
+                true
+            })
+        };
+
+        assert!(finished);
+
+        let mut seen = seen.into_inner().unwrap();
+        seen.sort_unstable();
+        seen
+    }
+
+    #[test]
+    fn chunks() {
+        // Sizes that are not multiples of the chunk size, one smaller than a chunk, and one that
+        // is not even a multiple of the page size
+        let mut buffers = [vec![0u8; 0x5000], vec![0u8; 0x1000], vec![0u8; 0x4800]];
+        let memslots = [(0x10000, 0), (0x16000, 1), (0x20000, 2)]
+            .iter()
+            .map(|&(base, i)| vm_memslot {
+                base,
+                host_base: buffers[i].as_mut_ptr() as u64,
+                map_size: buffers[i].len() as u64,
+            })
+            .collect::<Vec<_>>();
+        let table = TranslationTable::new(&memslots);
+
+        for (chunk_size, overlap, threads) in [
+            (0x2000, 0x100, 3),
+            // Rounded up to 0x2000
+            (0x1800, 0x100, 1),
+            // Overlap larger than a chunk
+            (0x1000, 0x2800, 2),
+            (0x2000, 0, 0),
+        ] {
+            let opts = ScanOptions {
+                chunk_size,
+                overlap,
+                threads,
+            };
+            let seen = scan_all(&table, opts);
+            let chunk_size = (chunk_size + PAGE_SIZE - 1) & !(PAGE_SIZE - 1);
+
+            for slot in table.slots() {
+                let end = slot.base + slot.size;
+                let chunks = seen
+                    .iter()
+                    .filter(|c| c.0 >= slot.base && c.0 < end)
+                    .collect::<Vec<_>>();
+
+                assert_eq!(
+                    chunks.len(),
+                    (slot.size as usize + chunk_size - 1) / chunk_size
+                );
+
+                // Owned parts tile the slot exactly
+                let mut next = slot.base;
+
+                for &&(address, host, len, owned) in &chunks {
+                    assert_eq!(address, next);
+                    assert_eq!(host, slot.host_base + (address - slot.base) as usize);
+                    assert_eq!(owned, chunk_size.min((end - address) as usize));
+                    // Overlap extends into the next chunk, but never past the slot
+                    assert_eq!(len, (owned + overlap).min((end - address) as usize));
+                    next += owned as u64;
+                }
+
+                assert_eq!(next, end);
+            }
+        }
+    }
+
+    #[test]
+    fn stop() {
+        let mut buffer = vec![0u8; 0x10000];
+        let memslots = [vm_memslot {
+            base: 0,
+            host_base: buffer.as_mut_ptr() as u64,
+            map_size: buffer.len() as u64,
+        }];
+        let table = TranslationTable::new(&memslots);
+        let opts = ScanOptions {
+            chunk_size: 0x1000,
+            overlap: 0,
+            threads: 1,
+        };
+        let calls = AtomicUsize::new(0);
+
+        let finished = unsafe { scan(&table, opts, |_| calls.fetch_add(1, Ordering::Relaxed) < 2) };
+
+        assert!(!finished);
+        assert_eq!(calls.load(Ordering::Relaxed), 3);
+    }
+}
@@ -0,0 +1,252 @@
+//! Read and write instrumentation
+//!
+//! Every connector instance records into its own set of counters. A connector is only ever used
+//! by one thread at a time, so the counters are updated with plain relaxed loads and stores,
+//! without any atomic read-modify-write operations. Counters of all clones are registered in a
+//! shared `Stats` structure, which sums them up when a snapshot is taken.
+//!
+//! Instrumentation is disabled by default, in which case the connector does not hold a recorder,
+//! and the only cost is a branch per request.
+
+use crate::translate::TranslationTable;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex, Weak};
+use std::time::Duration;
+
+/// Number of buckets in log2 histograms. Bucket `n` holds values in `[2^(n-1); 2^n)`, while
+/// bucket 0 holds zeroes.
+pub const HISTOGRAM_BUCKETS: usize = 65;
+
+#[inline(always)]
+fn bucket(value: u64) -> usize {
+    (u64::BITS - value.leading_zeros()) as usize
+}
+
+/// Add to a counter that has only a single writer
+#[inline(always)]
+fn bump(counter: &AtomicU64, value: u64) {
+    counter.store(
+        counter.load(Ordering::Relaxed).wrapping_add(value),
+        Ordering::Relaxed,
+    );
+}
+
+/// Point in time copy of the connector statistics
+#[derive(Clone, Debug, Default)]
+pub struct StatsSnapshot {
+    /// Number of bytes successfully read
+    pub bytes_read: u64,
+    /// Number of bytes successfully written
+    pub bytes_written: u64,
+    /// Number of read requests
+    pub read_requests: u64,
+    /// Number of write requests
+    pub write_requests: u64,
+    /// Number of request parts that fell into unmapped guest physical memory
+    pub hole_hits: u64,
+    /// Number of bytes that fell into unmapped guest physical memory
+    pub hole_bytes: u64,
+    /// Number of batches (calls to `phys_read_raw_iter`, or `phys_write_raw_iter`)
+    pub batches: u64,
+    /// Total time spent servicing batches
+    pub batch_time: Duration,
+    /// Bytes read, and written per memory slot, in `TranslationTable::slots` order
+    pub slot_bytes: Vec<u64>,
+    /// Log2 histogram of request sizes, in bytes
+    pub request_sizes: Vec<u64>,
+    /// Log2 histogram of batch latencies, in nanoseconds
+    pub batch_latencies: Vec<u64>,
+}
+
+struct Counters {
+    bytes_read: AtomicU64,
+    bytes_written: AtomicU64,
+    read_requests: AtomicU64,
+    write_requests: AtomicU64,
+    hole_hits: AtomicU64,
+    hole_bytes: AtomicU64,
+    batches: AtomicU64,
+    batch_nanos: AtomicU64,
+    slot_bytes: Box<[AtomicU64]>,
+    request_sizes: [AtomicU64; HISTOGRAM_BUCKETS],
+    batch_latencies: [AtomicU64; HISTOGRAM_BUCKETS],
+}
+
+impl Counters {
+    fn new(slot_count: usize) -> Self {
+        Self {
+            bytes_read: Default::default(),
+            bytes_written: Default::default(),
+            read_requests: Default::default(),
+            write_requests: Default::default(),
+            hole_hits: Default::default(),
+            hole_bytes: Default::default(),
+            batches: Default::default(),
+            batch_nanos: Default::default(),
+            slot_bytes: (0..slot_count).map(|_| Default::default()).collect(),
+            request_sizes: std::array::from_fn(|_| Default::default()),
+            batch_latencies: std::array::from_fn(|_| Default::default()),
+        }
+    }
+
+    fn add_to(&self, snapshot: &mut StatsSnapshot) {
+        let get = |c: &AtomicU64| c.load(Ordering::Relaxed);
+
+        snapshot.bytes_read += get(&self.bytes_read);
+        snapshot.bytes_written += get(&self.bytes_written);
+        snapshot.read_requests += get(&self.read_requests);
+        snapshot.write_requests += get(&self.write_requests);
+        snapshot.hole_hits += get(&self.hole_hits);
+        snapshot.hole_bytes += get(&self.hole_bytes);
+        snapshot.batches += get(&self.batches);
+        snapshot.batch_time += Duration::from_nanos(get(&self.batch_nanos));
+
+        for (dst, src) in [
+            (&mut snapshot.slot_bytes, &self.slot_bytes[..]),
+            (&mut snapshot.request_sizes, &self.request_sizes[..]),
+            (&mut snapshot.batch_latencies, &self.batch_latencies[..]),
+        ] {
+            dst.resize(dst.len().max(src.len()), 0);
+            for (d, s) in dst.iter_mut().zip(src) {
+                *d += get(s);
+            }
+        }
+    }
+}
+
+struct StatsInner {
+    live: Vec<Weak<Counters>>,
+    /// Totals of recorders that have already been dropped
+    retired: StatsSnapshot,
+}
+
+/// Statistics shared by a connector, and all of its clones
+pub struct Stats {
+    slot_count: usize,
+    inner: Mutex<StatsInner>,
+}
+
+impl Stats {
+    pub fn new(slot_count: usize) -> Self {
+        Self {
+            slot_count,
+            inner: Mutex::new(StatsInner {
+                live: vec![],
+                retired: Default::default(),
+            }),
+        }
+    }
+
+    /// Sum up the counters of all connector instances
+    pub fn snapshot(&self) -> StatsSnapshot {
+        let inner = self.inner.lock().unwrap_or_else(|e| e.into_inner());
+        let mut snapshot = inner.retired.clone();
+
+        for counters in inner.live.iter().filter_map(Weak::upgrade) {
+            counters.add_to(&mut snapshot);
+        }
+
+        snapshot
+    }
+}
+
+/// Per connector instance recorder
+pub struct StatsRecorder {
+    stats: Arc<Stats>,
+    counters: Arc<Counters>,
+}
+
+impl StatsRecorder {
+    pub fn new(stats: Arc<Stats>) -> Self {
+        let counters = Arc::new(Counters::new(stats.slot_count));
+
+        stats
+            .inner
+            .lock()
+            .unwrap_or_else(|e| e.into_inner())
+            .live
+            .push(Arc::downgrade(&counters));
+
+        Self { stats, counters }
+    }
+
+    pub fn stats(&self) -> &Arc<Stats> {
+        &self.stats
+    }
+
+    #[inline]
+    fn record_access(&self, table: &TranslationTable, addr: u64, len: usize) {
+        let c = &self.counters;
+
+        if let Some(slot) = table.lookup(addr).and_then(|(id, _)| c.slot_bytes.get(id)) {
+            bump(slot, len as u64);
+        }
+    }
+
+    /// Record a successfully read part of a request
+    #[inline]
+    pub fn record_read(&self, table: &TranslationTable, addr: u64, len: usize) {
+        bump(&self.counters.bytes_read, len as u64);
+        self.record_access(table, addr, len);
+    }
+
+    /// Record a successfully written part of a request
+    #[inline]
+    pub fn record_write(&self, table: &TranslationTable, addr: u64, len: usize) {
+        bump(&self.counters.bytes_written, len as u64);
+        self.record_access(table, addr, len);
+    }
+
+    /// Record a part of a request that fell into a hole
+    #[inline]
+    pub fn record_hole(&self, len: usize) {
+        bump(&self.counters.hole_hits, 1);
+        bump(&self.counters.hole_bytes, len as u64);
+    }
+
+    /// Record a new request, before it is split up
+    #[inline]
+    pub fn record_request(&self, write: bool, len: usize) {
+        let c = &self.counters;
+
+        bump(
+            if write {
+                &c.write_requests
+            } else {
+                &c.read_requests
+            },
+            1,
+        );
+        bump(&c.request_sizes[bucket(len as u64)], 1);
+    }
+
+    /// Record a completed batch
+    #[inline]
+    pub fn record_batch(&self, elapsed: Duration) {
+        let c = &self.counters;
+        let nanos = elapsed.as_nanos().min(u64::MAX as u128) as u64;
+
+        bump(&c.batches, 1);
+        bump(&c.batch_nanos, nanos);
+        bump(&c.batch_latencies[bucket(nanos)], 1);
+    }
+}
+
+impl Clone for StatsRecorder {
+    fn clone(&self) -> Self {
+        Self::new(self.stats.clone())
+    }
+}
+
+impl Drop for StatsRecorder {
+    fn drop(&mut self) {
+        let mut inner = self.stats.inner.lock().unwrap_or_else(|e| e.into_inner());
+        let counters = Arc::downgrade(&self.counters);
+
+        // Unregister before merging, so that snapshots never count the recorder twice
+        inner
+            .live
+            .retain(|c| !c.ptr_eq(&counters) && c.strong_count() > 0);
+        self.counters.add_to(&mut inner.retired);
+    }
+}
@@ -0,0 +1,152 @@
+//! Cache friendly bulk copies
+//!
+//! Regular copies pull both the source and the destination through the entire cache hierarchy.
+//! When dumping, or scanning gigabytes of guest memory, this flushes the shared last level cache,
+//! and slows down the guest, and its neighbours on the same socket. Streaming copies prefetch the
+//! source with the non-temporal hint, use non-temporal loads where the source alignment permits,
+//! and write the destination with non-temporal stores that bypass the cache.
+//!
+//! The widest available instruction set is picked at runtime.
+
+/// Reads smaller than this are copied through the cache
+pub const STREAM_MIN: usize = 0x40000;
+
+/// Bulk copies are split up at 2 MiB source boundaries, so that every chunk covers at most a
+/// single huge page of the guest.
+const CHUNK_SIZE: usize = 0x200000;
+
+/// Copy `len` bytes from `src` to `dst` with non-temporal loads and stores
+///
+/// # Safety
+///
+/// Same as `ptr::copy_nonoverlapping`.
+pub unsafe fn copy(src: *const u8, dst: *mut u8, len: usize) {
+    let mut off = 0;
+
+    while off < len {
+        let chunk_end = ((src as usize + off + CHUNK_SIZE) & !(CHUNK_SIZE - 1)) - src as usize;
+        let chunk_len = chunk_end.min(len) - off;
+        copy_chunk(src.add(off), dst.add(off), chunk_len);
+        off += chunk_len;
+    }
+
+    #[cfg(target_arch = "x86_64")]
+    std::arch::x86_64::_mm_sfence();
+}
+
+#[cfg(target_arch = "x86_64")]
+unsafe fn copy_chunk(src: *const u8, dst: *mut u8, len: usize) {
+    if is_x86_feature_detected!("avx2") {
+        x86::copy_aligned::<32>(src, dst, len, x86::copy_avx2)
+    } else if is_x86_feature_detected!("sse4.1") {
+        x86::copy_aligned::<16>(src, dst, len, x86::copy_sse41)
+    } else {
+        std::ptr::copy_nonoverlapping(src, dst, len)
+    }
+}
+
+#[cfg(not(target_arch = "x86_64"))]
+unsafe fn copy_chunk(src: *const u8, dst: *mut u8, len: usize) {
+    std::ptr::copy_nonoverlapping(src, dst, len)
+}
+
+#[cfg(target_arch = "x86_64")]
+mod x86 {
+    use std::arch::x86_64::*;
+    use std::ptr;
+
+    /// Distance to prefetch the source ahead of the copy
+    const PREFETCH_AHEAD: usize = 512;
+
+    /// Copy the unaligned head and tail regularly, and the aligned body with `body`
+    ///
+    /// `body` receives a destination aligned to `ALIGN` bytes, and a length that is a multiple of
+    /// `4 * ALIGN` bytes.
+    #[inline(always)]
+    pub unsafe fn copy_aligned<const ALIGN: usize>(
+        src: *const u8,
+        dst: *mut u8,
+        len: usize,
+        body: unsafe fn(*const u8, *mut u8, usize),
+    ) {
+        let head = dst.align_offset(ALIGN).min(len);
+        ptr::copy_nonoverlapping(src, dst, head);
+
+        let body_len = (len - head) & !(4 * ALIGN - 1);
+        body(src.add(head), dst.add(head), body_len);
+
+        let tail = head + body_len;
+        ptr::copy_nonoverlapping(src.add(tail), dst.add(tail), len - tail);
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn copy_avx2(src: *const u8, dst: *mut u8, len: usize) {
+        let aligned_src = src as usize % 32 == 0;
+        let mut off = 0;
+
+        while off < len {
+            _mm_prefetch::<_MM_HINT_NTA>(src.wrapping_add(off + PREFETCH_AHEAD) as *const i8);
+            _mm_prefetch::<_MM_HINT_NTA>(src.wrapping_add(off + PREFETCH_AHEAD + 64) as *const i8);
+
+            let s = src.add(off) as *const __m256i;
+            let d = dst.add(off) as *mut __m256i;
+
+            let v = if aligned_src {
+                [
+                    _mm256_stream_load_si256(s as *mut __m256i),
+                    _mm256_stream_load_si256(s.add(1) as *mut __m256i),
+                    _mm256_stream_load_si256(s.add(2) as *mut __m256i),
+                    _mm256_stream_load_si256(s.add(3) as *mut __m256i),
+                ]
+            } else {
+                [
+                    _mm256_loadu_si256(s),
+                    _mm256_loadu_si256(s.add(1)),
+                    _mm256_loadu_si256(s.add(2)),
+                    _mm256_loadu_si256(s.add(3)),
+                ]
+            };
+
+            for (i, v) in v.into_iter().enumerate() {
+                _mm256_stream_si256(d.add(i), v);
+            }
+
+            off += 128;
+        }
+    }
+
+    #[target_feature(enable = "sse4.1")]
+    pub unsafe fn copy_sse41(src: *const u8, dst: *mut u8, len: usize) {
+        let aligned_src = src as usize % 16 == 0;
+        let mut off = 0;
+
+        while off < len {
+            _mm_prefetch::<_MM_HINT_NTA>(src.wrapping_add(off + PREFETCH_AHEAD) as *const i8);
+
+            let s = src.add(off) as *const __m128i;
+            let d = dst.add(off) as *mut __m128i;
+
+            let v = if aligned_src {
+                [
+                    _mm_stream_load_si128(s as *mut __m128i),
+                    _mm_stream_load_si128(s.add(1) as *mut __m128i),
+                    _mm_stream_load_si128(s.add(2) as *mut __m128i),
+                    _mm_stream_load_si128(s.add(3) as *mut __m128i),
+                ]
+            } else {
+                [
+                    _mm_loadu_si128(s),
+                    _mm_loadu_si128(s.add(1)),
+                    _mm_loadu_si128(s.add(2)),
+                    _mm_loadu_si128(s.add(3)),
+                ]
+            };
+
+            for (i, v) in v.into_iter().enumerate() {
+                _mm_stream_si128(d.add(i), v);
+            }
+
+            off += 64;
+        }
+    }
+}
@@ -0,0 +1,161 @@
+//! Guest impact throttling
+//!
+//! A single scan over the mapped guest memory can saturate the memory bandwidth of the socket
+//! where the guest resides. `Throttle` is a token bucket that limits the number of bytes, and
+//! requests per second that a connector (and all of its clones) may issue.
+//!
+//! Optionally, the limits adapt to host memory pressure, as reported by the kernel's pressure
+//! stall information (`/proc/pressure/memory`). While the pressure is above the configured
+//! threshold, the rates are halved once per check interval, and then gradually restored once the
+//! pressure goes away.
+
+use log::warn;
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+
+/// Bucket capacity, in seconds worth of tokens
+const BURST_SECS: f64 = 0.05;
+
+/// How often the memory pressure is sampled
+const PSI_INTERVAL: Duration = Duration::from_secs(1);
+
+/// Lowest fraction of the configured rates that pressure adaptation can throttle down to
+const MIN_SCALE: f64 = 1.0 / 64.0;
+
+/// Fraction of the configured rates restored per check interval without pressure
+const SCALE_STEP: f64 = 0.1;
+
+/// Throttle configuration
+#[derive(Clone, Copy, Debug, Default)]
+pub struct ThrottleConfig {
+    /// Maximum number of bytes per second. 0 means unlimited.
+    pub bytes_per_sec: u64,
+    /// Maximum number of requests per second. 0 means unlimited.
+    pub requests_per_sec: u64,
+    /// Host memory pressure (`some avg10` percentage) above which the rates get reduced
+    pub psi_threshold: Option<f64>,
+}
+
+struct State {
+    bytes: f64,
+    requests: f64,
+    last_refill: Instant,
+    scale: f64,
+    last_psi: Instant,
+    /// Whether a failure to read the memory pressure has already been reported
+    psi_warned: bool,
+}
+
+/// Token bucket shared by a connector, and all of its clones
+pub struct Throttle {
+    config: ThrottleConfig,
+    state: Mutex<State>,
+}
+
+impl Throttle {
+    pub fn new(config: ThrottleConfig) -> Self {
+        let now = Instant::now();
+
+        Self {
+            config,
+            state: Mutex::new(State {
+                bytes: config.bytes_per_sec as f64 * BURST_SECS,
+                requests: config.requests_per_sec as f64 * BURST_SECS,
+                last_refill: now,
+                scale: 1.0,
+                last_psi: now,
+                psi_warned: false,
+            }),
+        }
+    }
+
+    pub fn config(&self) -> &ThrottleConfig {
+        &self.config
+    }
+
+    /// Current fraction of the configured rates, as adjusted by memory pressure
+    pub fn scale(&self) -> f64 {
+        self.state.lock().unwrap_or_else(|e| e.into_inner()).scale
+    }
+
+    /// Take tokens for the given amount of bytes and requests, blocking until they are available
+    ///
+    /// The bucket is allowed to go into debt, so requests larger than its capacity are not
+    /// rejected. Instead, the caller sleeps until its own debt is repaid, and only then returns to
+    /// perform the access.
+    pub fn acquire(&self, bytes: u64, requests: u64) {
+        let wait = {
+            let mut state = self.state.lock().unwrap_or_else(|e| e.into_inner());
+            let now = Instant::now();
+
+            if let Some(threshold) = self.config.psi_threshold {
+                if now.duration_since(state.last_psi) >= PSI_INTERVAL {
+                    state.last_psi = now;
+                    state.scale = match memory_pressure() {
+                        Ok(psi) if psi > threshold => (state.scale * 0.5).max(MIN_SCALE),
+                        Ok(_) => (state.scale + SCALE_STEP).min(1.0),
+                        Err(e) => {
+                            if !state.psi_warned {
+                                warn!("unable to read memory pressure, not adapting to it: {}", e);
+                                state.psi_warned = true;
+                            }
+                            (state.scale + SCALE_STEP).min(1.0)
+                        }
+                    };
+                }
+            }
+
+            let elapsed = now.duration_since(state.last_refill).as_secs_f64();
+            state.last_refill = now;
+            let state = &mut *state;
+            let scale = state.scale;
+
+            let mut wait = 0f64;
+
+            for (tokens, rate, amount) in [
+                (&mut state.bytes, self.config.bytes_per_sec, bytes),
+                (&mut state.requests, self.config.requests_per_sec, requests),
+            ] {
+                if rate == 0 {
+                    continue;
+                }
+
+                let rate = rate as f64 * scale;
+                *tokens = (*tokens + elapsed * rate).min(rate * BURST_SECS) - amount as f64;
+
+                if *tokens < 0.0 {
+                    wait = wait.max(-*tokens / rate);
+                }
+            }
+
+            wait
+        };
+
+        if wait > 0.0 {
+            std::thread::sleep(Duration::from_secs_f64(wait));
+        }
+    }
+}
+
+/// Read the `some avg10` host memory pressure percentage
+///
+/// Fails if the kernel does not provide pressure stall information (`CONFIG_PSI` is disabled, or
+/// `psi=0` is passed on its command line).
+pub fn memory_pressure() -> std::io::Result<f64> {
+    let psi = std::fs::read_to_string("/proc/pressure/memory")?;
+
+    psi.lines()
+        .find(|l| l.starts_with("some "))
+        .and_then(|l| {
+            l.split_whitespace()
+                .find_map(|f| f.strip_prefix("avg10="))?
+                .parse()
+                .ok()
+        })
+        .ok_or_else(|| {
+            std::io::Error::new(
+                std::io::ErrorKind::InvalidData,
+                "malformed /proc/pressure/memory",
+            )
+        })
+}
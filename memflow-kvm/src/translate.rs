@@ -0,0 +1,398 @@
+//! Constant time guest physical to host address translation
+//!
+//! `MemoryMap` performs a search over all mappings for every access. With a handful of memslots
+//! that is cheap, but page table walks issue millions of tiny reads, and the search ends up
+//! dominating the actual copy. `TranslationTable` instead mirrors the x86 paging structure: every
+//! guest physical address is resolved with at most 4 indexing operations, regardless of the number
+//! of slots.
+
+use memflow_kvm_ioctl::vm_memslot;
+
+/// Shift of the top level of the table. Each top level entry covers 512 GiB.
+const TOP_SHIFT: u32 = 39;
+/// Shift of the lowest level of the table. Each entry at this level covers a single page.
+const PAGE_SHIFT: u32 = 12;
+/// Number of address bits consumed by every level below the top one.
+const LEVEL_BITS: u32 = 9;
+const LEVEL_ENTRIES: usize = 1 << LEVEL_BITS;
+const LEVEL_MASK: u64 = LEVEL_ENTRIES as u64 - 1;
+
+/// Entry is not backed by any slot.
+const HOLE: u32 = 0;
+/// Entry points to a directory, the rest of the bits are its index. Otherwise, the entry is a
+/// leaf, and it stores the index of the slot plus one.
+const DIR: u32 = 1 << 31;
+
+/// A single guest to host memory mapping
+#[derive(Clone, Copy, Debug)]
+pub struct TableSlot {
+    /// Base physical address in the guest
+    pub base: u64,
+    /// Size of the mapping
+    pub size: u64,
+    /// Host virtual address where the guest base resides in
+    pub host_base: usize,
+}
+
+/// Multi-level lookup table indexed by guest physical address bits
+#[derive(Clone, Debug, Default)]
+pub struct TranslationTable {
+    slots: Vec<TableSlot>,
+    top: Vec<u32>,
+    dirs: Vec<[u32; LEVEL_ENTRIES]>,
+    max_address: u64,
+    real_size: u64,
+}
+
+impl TranslationTable {
+    /// Build the table out of mapped memory slots
+    ///
+    /// Slots are expected to be non-overlapping. If they do overlap, the first slot in address
+    /// order takes precedence.
+    pub fn new(memslots: &[vm_memslot]) -> Self {
+        let mut slots = memslots
+            .iter()
+            .filter(|s| s.map_size != 0)
+            .map(|s| TableSlot {
+                base: s.base,
+                size: s.map_size,
+                host_base: s.host_base as usize,
+            })
+            .collect::<Vec<_>>();
+
+        slots.sort_by_key(|s| s.base);
+
+        let mut table = Self {
+            max_address: slots
+                .iter()
+                .map(|s| s.base + s.size - 1)
+                .max()
+                .unwrap_or_default(),
+            real_size: slots.iter().map(|s| s.size).sum(),
+            ..Default::default()
+        };
+
+        for (id, slot) in slots.iter().enumerate() {
+            table.insert(slot.base, slot.base + slot.size, id as u32);
+        }
+
+        table.slots = slots;
+
+        table
+    }
+
+    /// Mapped slots, sorted by base address
+    pub fn slots(&self) -> &[TableSlot] {
+        &self.slots
+    }
+
+    /// Highest mapped guest physical address
+    pub fn max_address(&self) -> u64 {
+        self.max_address
+    }
+
+    /// Total number of mapped bytes
+    pub fn real_size(&self) -> u64 {
+        self.real_size
+    }
+
+    /// Find the slot containing `gpa`
+    #[inline(always)]
+    pub fn lookup(&self, gpa: u64) -> Option<(usize, &TableSlot)> {
+        let mut entry = *self.top.get((gpa >> TOP_SHIFT) as usize)?;
+
+        for shift in [30, 21, PAGE_SHIFT] {
+            if entry & DIR == 0 {
+                break;
+            }
+            // SAFETY: directory indices are only ever created by `fill`, and all point into `dirs`.
+            let dir = unsafe { self.dirs.get_unchecked((entry & !DIR) as usize) };
+            entry = dir[((gpa >> shift) & LEVEL_MASK) as usize];
+        }
+
+        if entry == HOLE {
+            return None;
+        }
+
+        let id = (entry - 1) as usize;
+        let slot = &self.slots[id];
+
+        if gpa.wrapping_sub(slot.base) < slot.size {
+            Some((id, slot))
+        } else {
+            self.lookup_edge(gpa, id)
+        }
+    }
+
+    /// Pages at slot edges may be only partially covered by the slot that owns the leaf, and the
+    /// rest of them covered by the slots that follow it.
+    #[cold]
+    fn lookup_edge(&self, gpa: u64, id: usize) -> Option<(usize, &TableSlot)> {
+        self.slots[id + 1..]
+            .iter()
+            .take_while(|s| s.base <= gpa)
+            .position(|s| gpa - s.base < s.size)
+            .map(|i| (id + 1 + i, &self.slots[id + 1 + i]))
+    }
+
+    /// Translate `gpa` to a host address
+    ///
+    /// Returns the host address, and the number of bytes that are contiguously mapped starting from
+    /// it. `None` is returned if the address falls into a hole.
+    #[inline(always)]
+    pub fn translate(&self, gpa: u64) -> Option<(usize, u64)> {
+        self.lookup(gpa).map(|(_, slot)| {
+            let off = gpa - slot.base;
+            (slot.host_base + off as usize, slot.size - off)
+        })
+    }
+
+    /// Find the base address of the first slot after `gpa`
+    ///
+    /// This is used to determine the size of a hole.
+    pub fn next_mapped(&self, gpa: u64) -> Option<u64> {
+        let idx = self.slots.partition_point(|s| s.base <= gpa);
+        self.slots.get(idx).map(|s| s.base)
+    }
+
+    fn insert(&mut self, start: u64, end: u64, id: u32) {
+        let mut addr = start;
+
+        while addr < end {
+            let idx = (addr >> TOP_SHIFT) as usize;
+
+            if idx >= self.top.len() {
+                self.top.resize(idx + 1, HOLE);
+            }
+
+            let chunk_end = end.min((idx as u64 + 1) << TOP_SHIFT);
+            self.top[idx] = self.fill(self.top[idx], TOP_SHIFT, addr, chunk_end, id);
+            addr = chunk_end;
+        }
+    }
+
+    /// Map `[start; end)` to slot `id` within an entry that covers `1 << shift` bytes
+    ///
+    /// Returns the new value of the entry.
+    fn fill(&mut self, entry: u32, shift: u32, start: u64, end: u64, id: u32) -> u32 {
+        // Already fully owned by another slot
+        if entry != HOLE && entry & DIR == 0 {
+            return entry;
+        }
+
+        let size = 1u64 << shift;
+
+        if entry == HOLE
+            && (shift == PAGE_SHIFT || (start & (size - 1) == 0 && end - start == size))
+        {
+            return id + 1;
+        }
+
+        let dir = if entry & DIR != 0 {
+            (entry & !DIR) as usize
+        } else {
+            self.dirs.push([HOLE; LEVEL_ENTRIES]);
+            self.dirs.len() - 1
+        };
+
+        let child_shift = shift - LEVEL_BITS;
+        let mut addr = start;
+
+        while addr < end {
+            let idx = ((addr >> child_shift) & LEVEL_MASK) as usize;
+            let chunk_end = end.min(((addr >> child_shift) + 1) << child_shift);
+            let child = self.dirs[dir][idx];
+            self.dirs[dir][idx] = self.fill(child, child_shift, addr, chunk_end, id);
+            addr = chunk_end;
+        }
+
+        DIR | dir as u32
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const GIB: u64 = 1 << 30;
+    const MIB: u64 = 1 << 20;
+
+    /// Host address of the first slot. Every slot gets its own 4 GiB of host address space.
+    const HOST: u64 = 0x7f00_0000_0000;
+
+    fn host(idx: usize) -> usize {
+        (HOST + ((idx as u64) << 32)) as usize
+    }
+
+    fn table(slots: &[(u64, u64)]) -> TranslationTable {
+        let memslots = slots
+            .iter()
+            .enumerate()
+            .map(|(i, &(base, map_size))| vm_memslot {
+                base,
+                host_base: host(i) as u64,
+                map_size,
+            })
+            .collect::<Vec<_>>();
+
+        TranslationTable::new(&memslots)
+    }
+
+    /// Check translation of `gpa`, expecting it to be in slot `idx` of `slots`
+    fn expect(t: &TranslationTable, slots: &[(u64, u64)], gpa: u64, idx: Option<usize>) {
+        let expected = idx.map(|i| {
+            let (base, size) = slots[i];
+            assert!(gpa >= base && gpa < base + size);
+            (host(i) + (gpa - base) as usize, size - (gpa - base))
+        });
+
+        assert_eq!(t.translate(gpa), expected, "gpa {:#x}", gpa);
+    }
+
+    /// Reference model of the table - the first slot in address order that contains `gpa`
+    fn owner(slots: &[(u64, u64)], gpa: u64) -> Option<usize> {
+        (0..slots.len())
+            .filter(|&i| gpa.wrapping_sub(slots[i].0) < slots[i].1)
+            .min_by_key(|&i| slots[i].0)
+    }
+
+    /// Check the first, and the last byte of every slot, and the bytes right outside of them
+    fn expect_edges(slots: &[(u64, u64)]) {
+        let t = table(slots);
+
+        for &(base, size) in slots.iter().filter(|(_, size)| *size != 0) {
+            for gpa in [base.wrapping_sub(1), base, base + size - 1, base + size] {
+                expect(&t, slots, gpa, owner(slots, gpa));
+            }
+        }
+    }
+
+    #[test]
+    fn partial_edge_pages() {
+        let slots = [
+            (0x1000, 0x800),
+            // Shares a page with the previous slot
+            (0x1800, 0x1800),
+            // Starts, and ends in the middle of a page
+            (0x5400, 0x1a00),
+            // Smaller than a page, within the same page as the previous slot
+            (0x6e00, 0x100),
+        ];
+
+        let t = table(&slots);
+        expect_edges(&slots);
+
+        expect(&t, &slots, 0x17ff, Some(0));
+        expect(&t, &slots, 0x1800, Some(1));
+        expect(&t, &slots, 0x2fff, Some(1));
+        expect(&t, &slots, 0x3000, None);
+        expect(&t, &slots, 0x5000, None);
+        expect(&t, &slots, 0x53ff, None);
+        expect(&t, &slots, 0x5400, Some(2));
+        expect(&t, &slots, 0x6dff, Some(2));
+        expect(&t, &slots, 0x6e00, Some(3));
+        expect(&t, &slots, 0x6eff, Some(3));
+        expect(&t, &slots, 0x6f00, None);
+        expect(&t, &slots, 0x7000, None);
+
+        assert_eq!(t.lookup(0x6e80).map(|(id, _)| id), Some(3));
+        assert_eq!(t.real_size(), 0x800 + 0x1800 + 0x1a00 + 0x100);
+        assert_eq!(t.max_address(), 0x6eff);
+    }
+
+    #[test]
+    fn level_boundaries() {
+        let slots = [
+            // Crosses a 2 MiB boundary
+            (2 * MIB - 0x1000, 0x2000),
+            // Crosses a 1 GiB boundary, not aligned to 2 MiB at either end
+            (GIB - 3 * MIB - 0x3000, 6 * MIB),
+            // Crosses a 512 GiB boundary, covering full 1 GiB, and 2 MiB entries on both sides
+            (
+                (512 * GIB) - GIB - 4 * MIB - 0x1000,
+                2 * GIB + 8 * MIB + 0x2000,
+            ),
+            // Exactly one aligned 1 GiB entry
+            (1024 * GIB, GIB),
+        ];
+
+        let t = table(&slots);
+        expect_edges(&slots);
+
+        for boundary in [2 * MIB, GIB, 512 * GIB] {
+            let idx = slots
+                .iter()
+                .position(|&(b, s)| b < boundary && b + s > boundary);
+
+            expect(&t, &slots, boundary - 1, idx);
+            expect(&t, &slots, boundary, idx);
+        }
+
+        expect(&t, &slots, 2 * MIB + 0x1000, None);
+        expect(&t, &slots, 1024 * GIB - 1, None);
+        expect(&t, &slots, 1025 * GIB, None);
+        expect(&t, &slots, 513 * GIB + 4 * MIB, Some(2));
+        expect(&t, &slots, 512 * GIB - GIB / 2, Some(2));
+        expect(&t, &slots, 1024 * GIB + GIB / 2, Some(3));
+
+        // Addresses past the end of the top level
+        expect(&t, &slots, 1 << 48, None);
+        expect(&t, &slots, u64::MAX, None);
+    }
+
+    #[test]
+    fn holes() {
+        let slots = [(0x10000, 0x1000), (0x20000, 0x3000), (4 * GIB, 2 * MIB)];
+        let t = table(&slots);
+        expect_edges(&slots);
+
+        expect(&t, &slots, 0, None);
+        expect(&t, &slots, 0x11000, None);
+        expect(&t, &slots, 0x1ffff, None);
+        expect(&t, &slots, 0x23000, None);
+        expect(&t, &slots, 4 * GIB - 1, None);
+
+        assert_eq!(t.next_mapped(0), Some(0x10000));
+        assert_eq!(t.next_mapped(0x10000), Some(0x20000));
+        assert_eq!(t.next_mapped(0x11000), Some(0x20000));
+        assert_eq!(t.next_mapped(0x1ffff), Some(0x20000));
+        assert_eq!(t.next_mapped(0x23000), Some(4 * GIB));
+        assert_eq!(t.next_mapped(4 * GIB), None);
+        assert_eq!(t.next_mapped(u64::MAX), None);
+
+        assert_eq!(t.max_address(), 4 * GIB + 2 * MIB - 1);
+        assert_eq!(t.real_size(), 0x1000 + 0x3000 + 2 * MIB);
+    }
+
+    #[test]
+    fn overlapping_slots() {
+        // Passed out of order, they get sorted by base address
+        let slots = [
+            (0x2800, 0x2800),
+            (0x0, 0x3000),
+            (0x1000, 0x1000),
+            (0x0, 0),
+            (4 * MIB, 4 * MIB),
+            (2 * MIB + 0x1000, 4 * MIB),
+        ];
+        let t = table(&slots);
+        expect_edges(&slots);
+
+        // The first slot in address order wins
+        expect(&t, &slots, 0x0, Some(1));
+        expect(&t, &slots, 0x1800, Some(1));
+        expect(&t, &slots, 0x2fff, Some(1));
+        expect(&t, &slots, 0x3000, Some(0));
+        expect(&t, &slots, 0x4fff, Some(0));
+        expect(&t, &slots, 0x5000, None);
+
+        expect(&t, &slots, 2 * MIB + 0x1000, Some(5));
+        expect(&t, &slots, 4 * MIB, Some(5));
+        expect(&t, &slots, 6 * MIB + 0xfff, Some(5));
+        expect(&t, &slots, 6 * MIB + 0x1000, Some(4));
+        expect(&t, &slots, 8 * MIB - 1, Some(4));
+
+        // Zero sized slots are dropped
+        assert_eq!(t.slots().len(), 5);
+    }
+}
@@ -0,0 +1,668 @@
+/* SPDX-License-Identifier: (GPL-2.0 WITH Linux-syscall-note) OR MIT */
+
+#ifndef MEMFLOW_VM_H
+#define MEMFLOW_VM_H
+
+/**
+ * @file memflow_vm.h
+ * @brief Header-only userspace library over memflow kernel module ABI
+ *
+ * Opens and maps a KVM virtual machine through `/dev/memflow`, and provides fast access to its
+ * physical memory: constant time guest physical address translation, and batched scatter-gather
+ * reads and writes.
+ *
+ * Translation, and single reads and writes may be performed from multiple threads at once. Batched
+ * operations use scratch space stored in the VM structure, thus they must not be invoked
+ * concurrently on the same instance.
+ *
+ * The library is C99, and C++11 compatible, but relies on POSIX.1-2008 (`O_CLOEXEC`). It requests
+ * it through `_POSIX_C_SOURCE`, which only has an effect if this header is included before any
+ * system header. Otherwise, compile with `-std=gnu99` or later, or define `_POSIX_C_SOURCE` to
+ * at least `200809L` on the command line. `MVM_AUTO`, and prefetching require GCC, or Clang.
+*/
+
+#if !defined(_GNU_SOURCE) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "mabi.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/// Shift of the top level of the translation table. Each top level entry covers 512 GiB
+#define MVM_TOP_SHIFT 39
+/// Shift of the lowest level of the translation table. Each entry at this level covers a page
+#define MVM_PAGE_SHIFT 12
+#define MVM_LEVEL_BITS 9
+#define MVM_LEVEL_ENTRIES (1u << MVM_LEVEL_BITS)
+#define MVM_LEVEL_MASK (MVM_LEVEL_ENTRIES - 1)
+
+/// Translation table entry that is not backed by any slot
+#define MVM_HOLE 0u
+/// Translation table entry that points to a directory. Otherwise, entries store slot index plus one
+#define MVM_DIR (1u << 31)
+
+/// Batches smaller than this are transferred in submission order
+#define MVM_BATCH_MIN 16
+/// Number of batch elements to prefetch ahead of the one being copied
+#define MVM_PREFETCH_DISTANCE 8
+
+/// Automatically close the VM when the variable goes out of scope (GCC, and Clang only)
+#define MVM_AUTO __attribute__((cleanup(mvm_close)))
+
+/// @brief a single scatter-gather element
+typedef struct mvm_iovec {
+	/// Guest physical address
+	__u64 gpa;
+	/// Buffer to read into, or write from
+	void *buf;
+	/// Number of bytes to transfer
+	size_t len;
+	/// After the transfer - 0 on success, -EFAULT if any part of the range is not mapped
+	int status;
+} mvm_iovec_t;
+
+/// @brief translation table directory
+typedef struct mvm_dir {
+	__u32 entries[MVM_LEVEL_ENTRIES];
+} mvm_dir_t;
+
+/// @brief element of a sorted batch
+typedef struct mvm_batch_entry {
+	uintptr_t host;
+	size_t idx;
+} mvm_batch_entry_t;
+
+/// @brief mapped virtual machine
+typedef struct mvm_vm {
+	/// VM handle returned by MEMFLOW_OPEN_VM
+	int vm_fd;
+	/// Mapping handle returned by MEMFLOW_MAP_VM
+	int map_fd;
+	/// PID of userspace VM monitor
+	__kernel_pid_t pid;
+	/// Number of mapped memory slots
+	__u32 slot_count;
+	/// Memory slots mapped into the current process, sorted by base address
+	vm_memslot_t *slots;
+	/// Highest mapped guest physical address
+	__u64 max_address;
+
+	__u32 top_count;
+	__u32 *top;
+	__u32 dir_count;
+	__u32 dir_cap;
+	mvm_dir_t *dirs;
+
+	size_t scratch_cap;
+	mvm_batch_entry_t *scratch;
+} mvm_vm_t;
+
+static inline void mvm_close(mvm_vm_t *vm);
+
+/**
+ * @brief Map `[start; end)` to slot `id` within an entry that covers `1 << shift` bytes
+ *
+ * Stores the new value of the entry in `out`. Returns 0, or -ENOMEM.
+*/
+static inline int mvm__fill(mvm_vm_t *vm, __u32 entry, unsigned shift, __u64 start, __u64 end, __u32 id, __u32 *out)
+{
+	__u64 size = 1ull << shift, addr, chunk_end;
+	unsigned child_shift = shift - MVM_LEVEL_BITS;
+	__u32 dir, idx, child;
+	mvm_dir_t *dirs;
+	int ret;
+
+	// Already fully owned by another slot
+	if (entry != MVM_HOLE && !(entry & MVM_DIR)) {
+		*out = entry;
+		return 0;
+	}
+
+	if (entry == MVM_HOLE && (shift == MVM_PAGE_SHIFT || (!(start & (size - 1)) && end - start == size))) {
+		*out = id + 1;
+		return 0;
+	}
+
+	if (entry & MVM_DIR) {
+		dir = entry & ~MVM_DIR;
+	} else {
+		if (vm->dir_count == vm->dir_cap) {
+			dirs = (mvm_dir_t *)realloc(vm->dirs, sizeof(*dirs) * (vm->dir_cap ? vm->dir_cap * 2 : 8));
+			if (!dirs)
+				return -ENOMEM;
+			vm->dirs = dirs;
+			vm->dir_cap = vm->dir_cap ? vm->dir_cap * 2 : 8;
+		}
+		dir = vm->dir_count++;
+		memset(vm->dirs + dir, 0, sizeof(*vm->dirs));
+	}
+
+	for (addr = start; addr < end; addr = chunk_end) {
+		idx = (addr >> child_shift) & MVM_LEVEL_MASK;
+		chunk_end = ((addr >> child_shift) + 1) << child_shift;
+		if (chunk_end > end)
+			chunk_end = end;
+
+		// The directory array may be reallocated by the recursive call
+		child = vm->dirs[dir].entries[idx];
+		if ((ret = mvm__fill(vm, child, child_shift, addr, chunk_end, id, &child)))
+			return ret;
+		vm->dirs[dir].entries[idx] = child;
+	}
+
+	*out = MVM_DIR | dir;
+	return 0;
+}
+
+static inline int mvm__build_table(mvm_vm_t *vm)
+{
+	__u64 start, end, addr, chunk_end;
+	__u32 i, idx, top_count, *top;
+	int ret;
+
+	for (i = 0; i < vm->slot_count; i++) {
+		start = vm->slots[i].base;
+		end = start + vm->slots[i].map_size;
+
+		if (start == end)
+			continue;
+
+		if (end - 1 > vm->max_address)
+			vm->max_address = end - 1;
+
+		for (addr = start; addr < end; addr = chunk_end) {
+			idx = addr >> MVM_TOP_SHIFT;
+
+			if (idx >= vm->top_count) {
+				top_count = idx + 1;
+				top = (__u32 *)realloc(vm->top, sizeof(*top) * top_count);
+				if (!top)
+					return -ENOMEM;
+				memset(top + vm->top_count, 0, sizeof(*top) * (top_count - vm->top_count));
+				vm->top = top;
+				vm->top_count = top_count;
+			}
+
+			chunk_end = ((__u64)idx + 1) << MVM_TOP_SHIFT;
+			if (chunk_end > end)
+				chunk_end = end;
+
+			if ((ret = mvm__fill(vm, vm->top[idx], MVM_TOP_SHIFT, addr, chunk_end, i, vm->top + idx)))
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Open and map a virtual machine
+ *
+ * If `pid` is 0, any of the KVM VMs gets opened. Returns 0 on success, or a negative errno value.
+ * The VM has to be closed with `mvm_close`, even if opening fails.
+*/
+static inline int mvm_open(mvm_vm_t *vm, __kernel_pid_t pid)
+{
+	vm_info_t info;
+	vm_map_info_t map_info;
+	vm_memslot_t *slots;
+	__u32 cap = 64;
+	int memflow_fd, ret;
+
+	memset(vm, 0, sizeof(*vm));
+	vm->vm_fd = -1;
+	vm->map_fd = -1;
+
+	memflow_fd = open("/dev/memflow", O_RDONLY | O_CLOEXEC);
+
+	if (memflow_fd < 0)
+		return -errno;
+
+	vm->vm_fd = ioctl(memflow_fd, MEMFLOW_OPEN_VM, pid);
+	ret = -errno;
+	close(memflow_fd);
+
+	if (vm->vm_fd < 0)
+		return ret;
+
+	// The slot count is not known upfront, grow the buffer until all slots fit
+	for (;;) {
+		slots = (vm_memslot_t *)realloc(vm->slots, sizeof(*slots) * cap);
+		if (!slots)
+			return -ENOMEM;
+		vm->slots = slots;
+
+		info.slot_count = cap;
+		info.slots = slots;
+
+		if (ioctl(vm->vm_fd, MEMFLOW_VM_INFO, &info))
+			return -errno;
+
+		if (info.slot_count < cap)
+			break;
+
+		cap *= 2;
+	}
+
+	vm->pid = info.userspace_pid;
+
+	map_info.slot_count = cap;
+	map_info.slots = vm->slots;
+
+	vm->map_fd = ioctl(vm->vm_fd, MEMFLOW_MAP_VM, &map_info);
+
+	if (vm->map_fd < 0)
+		return -errno;
+
+	vm->slot_count = map_info.slot_count;
+
+	return mvm__build_table(vm);
+}
+
+/// @brief Unmap the virtual machine, and free all resources
+static inline void mvm_close(mvm_vm_t *vm)
+{
+	__u32 i;
+
+	if (vm->map_fd >= 0) {
+		for (i = 0; i < vm->slot_count; i++)
+			munmap((void *)(uintptr_t)vm->slots[i].host_base, vm->slots[i].map_size);
+		close(vm->map_fd);
+	}
+
+	if (vm->vm_fd >= 0)
+		close(vm->vm_fd);
+
+	free(vm->slots);
+	free(vm->top);
+	free(vm->dirs);
+	free(vm->scratch);
+
+	memset(vm, 0, sizeof(*vm));
+	vm->vm_fd = -1;
+	vm->map_fd = -1;
+}
+
+/**
+ * @brief Translate guest physical address to a host pointer
+ *
+ * Returns NULL if the address is not mapped. Otherwise, stores the number of bytes that are
+ * contiguously mapped starting from the address in `avail` (if it is not NULL).
+*/
+static inline void *mvm_translate(const mvm_vm_t *vm, __u64 gpa, size_t *avail)
+{
+	static const unsigned shifts[] = { 30, 21, MVM_PAGE_SHIFT };
+	const vm_memslot_t *slot;
+	__u64 idx = gpa >> MVM_TOP_SHIFT;
+	__u32 entry;
+	unsigned i;
+
+	if (idx >= vm->top_count)
+		return NULL;
+
+	entry = vm->top[idx];
+
+	for (i = 0; i < 3 && (entry & MVM_DIR); i++)
+		entry = vm->dirs[entry & ~MVM_DIR].entries[(gpa >> shifts[i]) & MVM_LEVEL_MASK];
+
+	if (entry == MVM_HOLE)
+		return NULL;
+
+	slot = vm->slots + entry - 1;
+
+	// Pages at slot edges may be only partially covered by the slot that owns the leaf, and the
+	// rest of them covered by the slots that follow it
+	while (gpa - slot->base >= slot->map_size) {
+		if (++slot == vm->slots + vm->slot_count || slot->base > gpa)
+			return NULL;
+	}
+
+	if (avail)
+		*avail = slot->map_size - (gpa - slot->base);
+
+	return (void *)(uintptr_t)(slot->host_base + (gpa - slot->base));
+}
+
+static inline void mvm__copy_page(void *dst, const void *src)
+{
+#if defined(__AVX2__)
+	__m256i *d = (__m256i *)dst;
+	const __m256i *s = (const __m256i *)src;
+	int i;
+
+	for (i = 0; i < 4096 / 32; i += 4) {
+		__m256i a = _mm256_loadu_si256(s + i);
+		__m256i b = _mm256_loadu_si256(s + i + 1);
+		__m256i c = _mm256_loadu_si256(s + i + 2);
+		__m256i e = _mm256_loadu_si256(s + i + 3);
+		_mm256_storeu_si256(d + i, a);
+		_mm256_storeu_si256(d + i + 1, b);
+		_mm256_storeu_si256(d + i + 2, c);
+		_mm256_storeu_si256(d + i + 3, e);
+	}
+#elif defined(__SSE2__)
+	__m128i *d = (__m128i *)dst;
+	const __m128i *s = (const __m128i *)src;
+	int i;
+
+	for (i = 0; i < 4096 / 16; i += 4) {
+		__m128i a = _mm_loadu_si128(s + i);
+		__m128i b = _mm_loadu_si128(s + i + 1);
+		__m128i c = _mm_loadu_si128(s + i + 2);
+		__m128i e = _mm_loadu_si128(s + i + 3);
+		_mm_storeu_si128(d + i, a);
+		_mm_storeu_si128(d + i + 1, b);
+		_mm_storeu_si128(d + i + 2, c);
+		_mm_storeu_si128(d + i + 3, e);
+	}
+#else
+	memcpy(dst, src, 4096);
+#endif
+}
+
+/**
+ * @brief Copy memory with kernels specialized for page table entry, and page sized transfers
+*/
+static inline void mvm_copy(void *dst, const void *src, size_t len)
+{
+	__u64 q;
+	__u32 d;
+
+	switch (len) {
+	case 8:
+		memcpy(&q, src, 8);
+		memcpy(dst, &q, 8);
+		break;
+	case 4:
+		memcpy(&d, src, 4);
+		memcpy(dst, &d, 4);
+		break;
+	case 4096:
+		mvm__copy_page(dst, src);
+		break;
+	default:
+		memcpy(dst, src, len);
+	}
+}
+
+/// @brief Transfer a single range, splitting it up across slots. Returns 0, or -EFAULT
+static inline int mvm__transfer(const mvm_vm_t *vm, __u64 gpa, void *buf, size_t len, int write)
+{
+	char *host, *cur = (char *)buf;
+	size_t avail;
+	int ret = 0;
+	__u32 i;
+
+	while (len) {
+		host = (char *)mvm_translate(vm, gpa, &avail);
+
+		if (!host) {
+			// Skip to the next slot
+			ret = -EFAULT;
+			avail = len;
+			for (i = 0; i < vm->slot_count; i++) {
+				if (vm->slots[i].base > gpa && vm->slots[i].base - gpa < avail)
+					avail = vm->slots[i].base - gpa;
+			}
+		}
+
+		if (avail > len)
+			avail = len;
+
+		if (host && write)
+			mvm_copy(host, cur, avail);
+		else if (host)
+			mvm_copy(cur, host, avail);
+
+		gpa += avail;
+		cur += avail;
+		len -= avail;
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Read guest physical memory
+ *
+ * Returns 0, or -EFAULT if any part of the range is not mapped. Unmapped parts of `buf` are left
+ * untouched.
+*/
+static inline int mvm_read(const mvm_vm_t *vm, __u64 gpa, void *buf, size_t len)
+{
+	size_t avail;
+	void *host = mvm_translate(vm, gpa, &avail);
+
+	if (host && len <= avail) {
+		mvm_copy(buf, host, len);
+		return 0;
+	}
+
+	return mvm__transfer(vm, gpa, buf, len, 0);
+}
+
+/**
+ * @brief Write guest physical memory
+ *
+ * Returns 0, or -EFAULT if any part of the range is not mapped.
+*/
+static inline int mvm_write(const mvm_vm_t *vm, __u64 gpa, const void *buf, size_t len)
+{
+	size_t avail;
+	void *host = mvm_translate(vm, gpa, &avail);
+
+	if (host && len <= avail) {
+		mvm_copy(host, buf, len);
+		return 0;
+	}
+
+	return mvm__transfer(vm, gpa, (void *)buf, len, 1);
+}
+
+static inline int mvm__batch_compare(const void *lhs, const void *rhs)
+{
+	uintptr_t l = ((const mvm_batch_entry_t *)lhs)->host;
+	uintptr_t r = ((const mvm_batch_entry_t *)rhs)->host;
+
+	return (l > r) - (l < r);
+}
+
+static inline void mvm__prefetch(uintptr_t host, int write)
+{
+	// The access type has to be a compile time constant
+	if (write)
+		__builtin_prefetch((const void *)host, 1);
+	else
+		__builtin_prefetch((const void *)host, 0);
+}
+
+static inline long mvm__transfer_batch(mvm_vm_t *vm, mvm_iovec_t *iov, size_t count, int write)
+{
+	mvm_batch_entry_t *scratch, *e, *next;
+	size_t i, n = 0, avail, len;
+	long failed = 0;
+	char *buf;
+	void *host;
+
+	if (count > vm->scratch_cap) {
+		scratch = (mvm_batch_entry_t *)realloc(vm->scratch, sizeof(*scratch) * count);
+		if (!scratch)
+			return -ENOMEM;
+		vm->scratch = scratch;
+		vm->scratch_cap = count;
+	}
+
+	// Requests that fit within a single slot are deferred to the sorted pass
+	for (i = 0; i < count; i++) {
+		host = mvm_translate(vm, iov[i].gpa, &avail);
+
+		if (host && iov[i].len <= avail) {
+			vm->scratch[n].host = (uintptr_t)host;
+			vm->scratch[n++].idx = i;
+			iov[i].status = 0;
+		} else {
+			iov[i].status = mvm__transfer(vm, iov[i].gpa, iov[i].buf, iov[i].len, write);
+			failed += !!iov[i].status;
+		}
+	}
+
+	qsort(vm->scratch, n, sizeof(*vm->scratch), mvm__batch_compare);
+
+	for (i = 0; i < n && i < MVM_PREFETCH_DISTANCE; i++)
+		mvm__prefetch(vm->scratch[i].host, write);
+
+	for (i = 0; i < n; i++) {
+		e = vm->scratch + i;
+		buf = (char *)iov[e->idx].buf;
+		len = iov[e->idx].len;
+
+		// Merge runs that are contiguous both in the guest, and in the buffers
+		while (i + 1 < n) {
+			next = vm->scratch + i + 1;
+			if (next->host != e->host + len || (char *)iov[next->idx].buf != buf + len)
+				break;
+			len += iov[next->idx].len;
+			i++;
+		}
+
+		if (i + MVM_PREFETCH_DISTANCE < n)
+			mvm__prefetch(vm->scratch[i + MVM_PREFETCH_DISTANCE].host, write);
+
+		if (write)
+			mvm_copy((void *)e->host, buf, len);
+		else
+			mvm_copy(buf, (void *)e->host, len);
+	}
+
+	return failed;
+}
+
+/**
+ * @brief Read multiple ranges of guest physical memory
+ *
+ * Large batches are serviced in host address order, with prefetching, and contiguous ranges merged
+ * into single copies. Status of every element is stored in its `status` field.
+ *
+ * Returns the number of elements that could not be fully read, or -ENOMEM.
+*/
+static inline long mvm_read_batch(mvm_vm_t *vm, mvm_iovec_t *iov, size_t count)
+{
+	long failed = 0;
+	size_t i;
+
+	if (count < MVM_BATCH_MIN) {
+		for (i = 0; i < count; i++)
+			failed += !!(iov[i].status = mvm_read(vm, iov[i].gpa, iov[i].buf, iov[i].len));
+		return failed;
+	}
+
+	return mvm__transfer_batch(vm, iov, count, 0);
+}
+
+/**
+ * @brief Write multiple ranges of guest physical memory
+ *
+ * Same as `mvm_read_batch`, but in the opposite direction.
+*/
+static inline long mvm_write_batch(mvm_vm_t *vm, mvm_iovec_t *iov, size_t count)
+{
+	long failed = 0;
+	size_t i;
+
+	if (count < MVM_BATCH_MIN) {
+		for (i = 0; i < count; i++)
+			failed += !!(iov[i].status = mvm_write(vm, iov[i].gpa, iov[i].buf, iov[i].len));
+		return failed;
+	}
+
+	return mvm__transfer_batch(vm, iov, count, 1);
+}
+
+#ifdef __cplusplus
+#include <system_error>
+#include <utility>
+
+namespace memflow {
+
+/// @brief RAII wrapper over `mvm_vm_t`
+class Vm {
+public:
+	/// Open and map a virtual machine. Throws `std::system_error` on failure
+	explicit Vm(__kernel_pid_t pid = 0)
+	{
+		int ret = mvm_open(&vm_, pid);
+
+		if (ret) {
+			mvm_close(&vm_);
+			throw std::system_error(-ret, std::generic_category(), "unable to map the VM");
+		}
+	}
+
+	Vm(const Vm &) = delete;
+	Vm &operator=(const Vm &) = delete;
+
+	Vm(Vm &&other) noexcept : vm_(other.vm_)
+	{
+		other.release();
+	}
+
+	Vm &operator=(Vm &&other) noexcept
+	{
+		if (this != &other) {
+			mvm_close(&vm_);
+			vm_ = other.vm_;
+			other.release();
+		}
+		return *this;
+	}
+
+	~Vm()
+	{
+		mvm_close(&vm_);
+	}
+
+	__kernel_pid_t pid() const { return vm_.pid; }
+	const vm_memslot_t *slots() const { return vm_.slots; }
+	__u32 slot_count() const { return vm_.slot_count; }
+	__u64 max_address() const { return vm_.max_address; }
+
+	void *translate(__u64 gpa, size_t *avail = nullptr) const { return mvm_translate(&vm_, gpa, avail); }
+	int read(__u64 gpa, void *buf, size_t len) const { return mvm_read(&vm_, gpa, buf, len); }
+	int write(__u64 gpa, const void *buf, size_t len) const { return mvm_write(&vm_, gpa, buf, len); }
+	long read_batch(mvm_iovec_t *iov, size_t count) { return mvm_read_batch(&vm_, iov, count); }
+	long write_batch(mvm_iovec_t *iov, size_t count) { return mvm_write_batch(&vm_, iov, count); }
+
+	template <typename T>
+	int read(__u64 gpa, T &out) const { return read(gpa, &out, sizeof(T)); }
+
+	mvm_vm_t *raw() { return &vm_; }
+
+private:
+	void release()
+	{
+		vm_ = mvm_vm_t();
+		vm_.vm_fd = -1;
+		vm_.map_fd = -1;
+	}
+
+	mvm_vm_t vm_;
+};
+
+}
+#endif
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * Self-contained checks of memflow_vm.h, that do not require the kernel module.
+ *
+ * VMs are assembled by hand out of memory slots, and translations, and reads are compared
+ * against a reference model of the slot layout. Build, and run with `make check`.
+*/
+
+#include "memflow_vm.h"
+#include <stdio.h>
+
+#define GIB (1ull << 30)
+#define MIB (1ull << 20)
+
+/// Fake host address of the first slot of translation only layouts. Every slot gets 4 GiB of it.
+#define HOST 0x7f0000000000ull
+
+static int failures;
+
+#define CHECK(cond, ...)                                            \
+	do {                                                        \
+		if (!(cond)) {                                      \
+			printf("%s:%d: ", __FILE__, __LINE__);      \
+			printf(__VA_ARGS__);                        \
+			printf("\n");                               \
+			failures++;                                 \
+		}                                                   \
+	} while (0)
+
+/// Assemble a VM out of `count` slots, given as base, and size pairs
+static void build(mvm_vm_t *vm, const __u64 (*layout)[2], __u32 count, char **buffers)
+{
+	__u32 i;
+
+	memset(vm, 0, sizeof(*vm));
+	vm->vm_fd = -1;
+	vm->map_fd = -1;
+	vm->slot_count = count;
+	vm->slots = (vm_memslot_t *)calloc(count, sizeof(*vm->slots));
+
+	for (i = 0; i < count; i++) {
+		vm->slots[i].base = layout[i][0];
+		vm->slots[i].map_size = layout[i][1];
+		vm->slots[i].host_base = buffers ? (uintptr_t)buffers[i] : HOST + ((__u64)i << 32);
+	}
+
+	CHECK(!mvm__build_table(vm), "building the table failed");
+}
+
+/// Reference model - the first slot in address order that contains `gpa`, or -1
+static int owner(const mvm_vm_t *vm, __u64 gpa)
+{
+	__u32 i;
+
+	for (i = 0; i < vm->slot_count; i++)
+		if (gpa - vm->slots[i].base < vm->slots[i].map_size)
+			return i;
+
+	return -1;
+}
+
+static void check_gpa(const mvm_vm_t *vm, __u64 gpa)
+{
+	int idx = owner(vm, gpa);
+	size_t avail = 0;
+	char *host = (char *)mvm_translate(vm, gpa, &avail);
+	const vm_memslot_t *slot;
+
+	if (idx < 0) {
+		CHECK(!host, "gpa %llx: expected a hole", (unsigned long long)gpa);
+		return;
+	}
+
+	slot = vm->slots + idx;
+
+	CHECK(host == (char *)(uintptr_t)(slot->host_base + (gpa - slot->base)), "gpa %llx: expected slot %d",
+	      (unsigned long long)gpa, idx);
+	CHECK(avail == slot->map_size - (gpa - slot->base), "gpa %llx: wrong avail %zx", (unsigned long long)gpa,
+	      avail);
+}
+
+/// Check the first, and the last byte of every slot, and the bytes right outside of them
+static void check_edges(const mvm_vm_t *vm)
+{
+	const vm_memslot_t *slot;
+	__u32 i;
+
+	for (i = 0; i < vm->slot_count; i++) {
+		slot = vm->slots + i;
+		check_gpa(vm, slot->base - 1);
+		check_gpa(vm, slot->base);
+		check_gpa(vm, slot->base + slot->map_size - 1);
+		check_gpa(vm, slot->base + slot->map_size);
+	}
+}
+
+static void test_level_boundaries(void)
+{
+	static const __u64 layout[][2] = {
+		// Crosses a 2 MiB boundary
+		{ 2 * MIB - 0x1000, 0x2000 },
+		// Crosses a 1 GiB boundary, not aligned to 2 MiB at either end
+		{ GIB - 3 * MIB - 0x3000, 6 * MIB },
+		// Crosses a 512 GiB boundary, covering full 1 GiB, and 2 MiB entries on both sides
+		{ 512 * GIB - GIB - 4 * MIB - 0x1000, 2 * GIB + 8 * MIB + 0x2000 },
+		// Exactly one aligned 1 GiB entry
+		{ 1024 * GIB, GIB },
+	};
+	mvm_vm_t vm;
+
+	build(&vm, layout, 4, NULL);
+	check_edges(&vm);
+
+	check_gpa(&vm, 2 * MIB);
+	check_gpa(&vm, GIB);
+	check_gpa(&vm, 512 * GIB);
+	check_gpa(&vm, 513 * GIB + 4 * MIB);
+	check_gpa(&vm, 1024 * GIB + GIB / 2);
+	check_gpa(&vm, 1025 * GIB);
+	check_gpa(&vm, 1ull << 48);
+	check_gpa(&vm, ~0ull);
+
+	mvm_close(&vm);
+}
+
+static void test_overlapping(void)
+{
+	// Sorted by base address, as the module returns them
+	static const __u64 layout[][2] = {
+		{ 0x0, 0x3000 },
+		{ 0x1000, 0x1000 },
+		{ 0x2800, 0x2800 },
+		{ 2 * MIB + 0x1000, 4 * MIB },
+		{ 4 * MIB, 4 * MIB },
+	};
+	mvm_vm_t vm;
+	__u64 gpa;
+
+	build(&vm, layout, 5, NULL);
+	check_edges(&vm);
+
+	for (gpa = 0; gpa < 9 * MIB; gpa += 0x800)
+		check_gpa(&vm, gpa);
+
+	mvm_close(&vm);
+}
+
+/// Slots that share pages, backed by real memory, so that reads can be checked
+static void test_partial_edge_pages(void)
+{
+	static const __u64 layout[][2] = {
+		{ 0x1000, 0x800 },
+		// Shares a page with the previous slot
+		{ 0x1800, 0x1800 },
+		// Starts, and ends in the middle of a page
+		{ 0x5400, 0x1a00 },
+		// Smaller than a page, within the same page as the previous slot
+		{ 0x6e00, 0x100 },
+	};
+	char *buffers[4], buf[0x3000], expected[0x3000];
+	mvm_iovec_t iov[MVM_BATCH_MIN * 2];
+	__u64 gpa, len;
+	mvm_vm_t vm;
+	int idx, ret;
+	__u32 i, j;
+
+	for (i = 0; i < 4; i++) {
+		buffers[i] = (char *)malloc(layout[i][1]);
+		for (j = 0; j < layout[i][1]; j++)
+			buffers[i][j] = (char)(i * 64 + j * 7);
+	}
+
+	build(&vm, layout, 4, buffers);
+	check_edges(&vm);
+
+	for (gpa = 0; gpa < 0x8000; gpa += 0x80)
+		check_gpa(&vm, gpa);
+
+	// Reads across every slot edge, and hole
+	for (gpa = 0x800; gpa < 0x7800; gpa += 0x380) {
+		for (len = 1; len <= sizeof(buf); len = len * 3 + 5) {
+			memset(buf, 0xaa, len);
+			memset(expected, 0xaa, len);
+			ret = 0;
+
+			for (j = 0; j < len; j++) {
+				idx = owner(&vm, gpa + j);
+				if (idx < 0)
+					ret = -EFAULT;
+				else
+					expected[j] = buffers[idx][gpa + j - layout[idx][0]];
+			}
+
+			CHECK(mvm_read(&vm, gpa, buf, len) == ret, "read %llx+%llx: wrong status",
+			      (unsigned long long)gpa, (unsigned long long)len);
+			CHECK(!memcmp(buf, expected, len), "read %llx+%llx: wrong data", (unsigned long long)gpa,
+			      (unsigned long long)len);
+		}
+	}
+
+	// Sorted batch path, page table entry sized reads around the shared page
+	for (i = 0; i < MVM_BATCH_MIN * 2; i++) {
+		iov[i].gpa = 0x1700 + i * 0x10;
+		iov[i].buf = buf + i * 8;
+		iov[i].len = 8;
+	}
+
+	CHECK(mvm_read_batch(&vm, iov, MVM_BATCH_MIN * 2) == 0, "batch read failed");
+
+	for (i = 0; i < MVM_BATCH_MIN * 2; i++) {
+		idx = owner(&vm, iov[i].gpa);
+		CHECK(!iov[i].status && !memcmp(buf + i * 8, buffers[idx] + (iov[i].gpa - layout[idx][0]), 8),
+		      "batch read %llx: wrong data", (unsigned long long)iov[i].gpa);
+	}
+
+	mvm_close(&vm);
+
+	for (i = 0; i < 4; i++)
+		free(buffers[i]);
+}
+
+int main(void)
+{
+	test_partial_edge_pages();
+	test_level_boundaries();
+	test_overlapping();
+
+	if (failures) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+
+	printf("all checks passed\n");
+	return 0;
+}